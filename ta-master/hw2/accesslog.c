@@ -0,0 +1,296 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "accesslog.h"
+#include "wq.h"
+
+/* Bytes of formatted entries collected before a write() */
+#define ACCESSLOG_BATCH_SIZE 65536
+
+/* Longest formatted entry: every path byte may need a \u00XX escape */
+#define ACCESSLOG_LINE_MAX (ACCESSLOG_PATH_MAX * 6 + 256)
+
+int accesslog_enabled;
+
+struct accesslog_entry {
+  struct timespec time;   // When the response was done
+  struct in_addr addr;    // Client, if known
+  uint16_t port;
+  int status;
+  size_t bytes;
+  uint64_t duration;      // Nanoseconds
+  char method[8];
+  char path[ACCESSLOG_PATH_MAX];
+};
+
+/* One thread's entries. Only the thread moves head, only the writer tail. */
+struct accesslog_ring {
+  size_t head __attribute__((aligned(WQ_CACHE_LINE)));
+  size_t tail __attribute__((aligned(WQ_CACHE_LINE)));
+  uint64_t dropped;
+  int owned;              // A live thread logs here
+  struct accesslog_ring *next;
+  struct accesslog_entry entries[ACCESSLOG_RING_SIZE];
+};
+
+static struct accesslog_ring *accesslog_rings;   // Every ring ever made
+static __thread struct accesslog_ring *accesslog_self;
+static pthread_key_t accesslog_key;
+
+static char *accesslog_path;
+static size_t accesslog_max_bytes;
+static int accesslog_fd = -1;
+static size_t accesslog_size;           // Of the open file
+static int accesslog_wake_fd;           // Signalled when a ring is half full
+static volatile sig_atomic_t accesslog_reopen_requested;
+
+/* Hand a ring back when its thread exits; the writer still drains it */
+static void accesslog_release(void *ring) {
+  __atomic_store_n(&((struct accesslog_ring *) ring)->owned, 0, __ATOMIC_RELEASE);
+}
+
+/* The calling thread's ring: one left by an exited thread, or a new one */
+static struct accesslog_ring *accesslog_ring(void) {
+  struct accesslog_ring *ring;
+
+  if (accesslog_self != NULL)
+    return accesslog_self;
+
+  for (ring = __atomic_load_n(&accesslog_rings, __ATOMIC_ACQUIRE); ring != NULL;
+      ring = ring->next) {
+    int owned = 0;
+    if (__atomic_compare_exchange_n(&ring->owned, &owned, 1, 0,
+          __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      break;
+  }
+
+  if (ring == NULL) {
+    if (posix_memalign((void **) &ring, WQ_CACHE_LINE, sizeof(struct accesslog_ring)) != 0)
+      return NULL;
+    memset(ring, 0, offsetof(struct accesslog_ring, entries));
+    ring->owned = 1;
+    ring->next = __atomic_load_n(&accesslog_rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&accesslog_rings, &ring->next, ring, 1,
+          __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+  }
+
+  pthread_setspecific(accesslog_key, ring);
+  accesslog_self = ring;
+  return ring;
+}
+
+void accesslog_record(struct http_conn *conn, uint64_t duration) {
+  struct accesslog_ring *ring = accesslog_ring();
+  if (ring == NULL)
+    return;
+
+  size_t head = ring->head;
+  size_t used = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  if (used == ACCESSLOG_RING_SIZE) {
+    __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  struct accesslog_entry *entry = &ring->entries[head % ACCESSLOG_RING_SIZE];
+  clock_gettime(CLOCK_REALTIME, &entry->time);
+  entry->addr = conn->peer.sin_addr;
+  entry->port = ntohs(conn->peer.sin_port);
+  entry->status = conn->status;
+  entry->bytes = conn->bytes_sent;
+  entry->duration = duration;
+  snprintf(entry->method, sizeof(entry->method), "%s",
+      conn->request.method ? conn->request.method : "-");
+  snprintf(entry->path, sizeof(entry->path), "%s",
+      conn->request.path ? conn->request.path : "-");
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+  /* Have the writer come early rather than let the ring overflow */
+  if (used + 1 == ACCESSLOG_RING_SIZE / 2) {
+    uint64_t one = 1;
+    if (write(accesslog_wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+      perror("Error waking access log writer");
+  }
+}
+
+void accesslog_reopen(void) {
+  accesslog_reopen_requested = 1;
+}
+
+static void accesslog_open(void) {
+  struct stat file_stat;
+
+  if (strcmp(accesslog_path, "-") == 0) {
+    accesslog_fd = STDOUT_FILENO;
+    return;
+  }
+  accesslog_fd = open(accesslog_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (accesslog_fd == -1) {
+    fprintf(stderr, "Cannot open access log %s: %s\n", accesslog_path, strerror(errno));
+    return;
+  }
+  accesslog_size = fstat(accesslog_fd, &file_stat) == 0 ? file_stat.st_size : 0;
+}
+
+/* Shift PATH to PATH.1, PATH.1 to PATH.2 and so on, and start a new file */
+static void accesslog_rotate(void) {
+  char from[PATH_MAX], to[PATH_MAX];
+  int i;
+
+  close(accesslog_fd);
+  for (i = ACCESSLOG_KEEP - 1; i >= 0; i--) {
+    if (i == 0)
+      snprintf(from, sizeof(from), "%s", accesslog_path);
+    else
+      snprintf(from, sizeof(from), "%s.%d", accesslog_path, i);
+    snprintf(to, sizeof(to), "%s.%d", accesslog_path, i + 1);
+    if (rename(from, to) == -1 && errno != ENOENT)
+      fprintf(stderr, "Cannot rotate %s: %s\n", from, strerror(errno));
+  }
+  accesslog_open();
+}
+
+static void accesslog_write(char *batch, size_t size) {
+  size_t offset = 0;
+
+  while (offset < size && accesslog_fd != -1) {
+    ssize_t written = write(accesslog_fd, batch + offset, size - offset);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written < 0) {
+      perror("Error writing access log");
+      break;
+    }
+    offset += written;
+  }
+  accesslog_size += size;
+
+  if (accesslog_max_bytes > 0 && accesslog_size >= accesslog_max_bytes &&
+      accesslog_fd != STDOUT_FILENO)
+    accesslog_rotate();
+}
+
+/* Append SRC to OUT as the contents of a JSON string */
+static char *accesslog_escape(char *out, char *src) {
+  for (; *src; src++) {
+    unsigned char c = *src;
+    if (c == '"' || c == '\\') {
+      *out++ = '\\';
+      *out++ = c;
+    } else if (c < 0x20 || c == 0x7f) {
+      out += sprintf(out, "\\u%04x", c);
+    } else {
+      *out++ = c;
+    }
+  }
+  return out;
+}
+
+static size_t accesslog_format(char *line, struct accesslog_entry *entry) {
+  static char stamp[32];
+  static time_t stamp_time = -1;
+  char addr[INET_ADDRSTRLEN];
+  struct tm tm;
+  char *out = line;
+
+  /* Most entries of a batch share their second */
+  if (entry->time.tv_sec != stamp_time) {
+    gmtime_r(&entry->time.tv_sec, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+    stamp_time = entry->time.tv_sec;
+  }
+  if (entry->addr.s_addr == 0 || inet_ntop(AF_INET, &entry->addr, addr, sizeof(addr)) == NULL)
+    strcpy(addr, "-");
+
+  out += sprintf(out, "{\"time\":\"%s.%03ldZ\",\"client\":\"%s:%u\",\"method\":\"",
+      stamp, entry->time.tv_nsec / 1000000, addr, entry->port);
+  out = accesslog_escape(out, entry->method);
+  out += sprintf(out, "\",\"path\":\"");
+  out = accesslog_escape(out, entry->path);
+  out += sprintf(out, "\",\"status\":%d,\"bytes\":%zu,\"duration_us\":%llu}\n",
+      entry->status, entry->bytes, (unsigned long long) (entry->duration / 1000));
+  return out - line;
+}
+
+/* Drain every ring into the log, ACCESSLOG_BATCH_SIZE bytes per write */
+static void *accesslog_loop(void *arg) {
+  static char batch[ACCESSLOG_BATCH_SIZE];
+  uint64_t reported_drops = 0;
+
+  while (1) {
+    struct pollfd pfd = { .fd = accesslog_wake_fd, .events = POLLIN };
+    uint64_t count;
+    if (poll(&pfd, 1, ACCESSLOG_FLUSH_INTERVAL) > 0 &&
+        read(accesslog_wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+      perror("Error reading access log wakeup");
+
+    if (accesslog_reopen_requested) {
+      accesslog_reopen_requested = 0;
+      if (accesslog_fd != STDOUT_FILENO) {
+        close(accesslog_fd);
+        accesslog_open();
+      }
+    }
+
+    struct accesslog_ring *ring;
+    uint64_t drops = 0;
+    size_t size = 0;
+    for (ring = __atomic_load_n(&accesslog_rings, __ATOMIC_ACQUIRE); ring != NULL;
+        ring = ring->next) {
+      size_t tail = ring->tail, head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+      for (; tail != head; tail++) {
+        if (size + ACCESSLOG_LINE_MAX > sizeof(batch)) {
+          accesslog_write(batch, size);
+          size = 0;
+        }
+        size += accesslog_format(batch + size, &ring->entries[tail % ACCESSLOG_RING_SIZE]);
+        /* Free each slot as soon as it is copied out */
+        __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+      }
+      drops += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    }
+    if (size > 0)
+      accesslog_write(batch, size);
+
+    if (drops > reported_drops) {
+      fprintf(stderr, "Access log fell behind; %llu entries dropped so far\n",
+          (unsigned long long) drops);
+      reported_drops = drops;
+    }
+  }
+  return NULL;
+}
+
+void accesslog_init(char *path, size_t max_bytes) {
+  accesslog_path = path;
+  accesslog_max_bytes = max_bytes;
+  accesslog_open();
+  if (accesslog_fd == -1)
+    exit(1);
+
+  pthread_key_create(&accesslog_key, accesslog_release);
+  if ((accesslog_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+    perror("Failed to create access log wakeup");
+    exit(errno);
+  }
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, accesslog_loop, NULL) != 0) {
+    fprintf(stderr, "Error in creating access log thread: %s\n", strerror(errno));
+    exit(1);
+  }
+  pthread_detach(thread);
+  accesslog_enabled = 1;
+}
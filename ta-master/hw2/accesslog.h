@@ -0,0 +1,48 @@
+#ifndef __ACCESSLOG__
+#define __ACCESSLOG__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "libhttp.h"
+
+/* ACCESSLOG writes one JSON line per response:
+ *
+ *   {"time":"2026-10-17T11:51:02.123Z","client":"127.0.0.1:53412",
+ *    "method":"GET","path":"/index.html","status":200,"bytes":4790,
+ *    "duration_us":41}
+ *
+ * Workers only copy the fields into a ring buffer of their own (a
+ * single-producer, single-consumer ring, so no lock or shared cache line);
+ * a background thread formats the entries of all rings in batches and
+ * writes each batch with one write(), so lines of different threads may be
+ * slightly out of order. A worker whose ring is full drops the entry rather
+ * than wait. */
+
+/* Entries each thread's ring holds */
+#define ACCESSLOG_RING_SIZE 4096
+
+/* Longest request path kept; longer ones are cut */
+#define ACCESSLOG_PATH_MAX 200
+
+/* Milliseconds between writes when the rings fill slowly */
+#define ACCESSLOG_FLUSH_INTERVAL 100
+
+/* Rotated files kept as PATH.1 (newest) to PATH.N */
+#define ACCESSLOG_KEEP 5
+
+/* Whether responses are logged; set by accesslog_init */
+extern int accesslog_enabled;
+
+/* Starts logging to the file PATH ("-" for standard output). A file is
+ * rotated once it grows past MAX_BYTES, unless that is 0. */
+void accesslog_init(char *path, size_t max_bytes);
+
+/* Logs the response just sent on CONN, which took DURATION nanoseconds. */
+void accesslog_record(struct http_conn *conn, uint64_t duration);
+
+/* Has the log file reopened before the next batch, e.g. after an outside
+ * tool moved it. Safe to call from a signal handler. */
+void accesslog_reopen(void);
+
+#endif
@@ -0,0 +1,200 @@
+#define _GNU_SOURCE
+
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "affinity.h"
+
+int affinity_numa;
+
+/* The CPUs we started with; pinned threads pass their one CPU on to the
+ * threads they create, so this is read once, before anything is pinned */
+static cpu_set_t affinity_allowed;
+static pthread_once_t affinity_once = PTHREAD_ONCE_INIT;
+
+/* Allowed CPUs for each role, narrowed by affinity_set_cpus */
+static cpu_set_t affinity_roles[AFFINITY_NUM_ROLES];
+static int affinity_listed[AFFINITY_NUM_ROLES];
+
+/* What threads are grouped by; a single node with every CPU without NUMA */
+static struct {
+  int id;                                   // Node number in sysfs
+  cpu_set_t cpus[AFFINITY_NUM_ROLES];
+} affinity_nodes[AFFINITY_MAX_NODES];
+static int affinity_nodes_size;
+static pthread_once_t affinity_nodes_once = PTHREAD_ONCE_INIT;
+
+static __thread int affinity_current_node;
+
+static void affinity_init(void) {
+  int role;
+  if (sched_getaffinity(0, sizeof(affinity_allowed), &affinity_allowed) == -1 ||
+      CPU_COUNT(&affinity_allowed) == 0) {
+    CPU_ZERO(&affinity_allowed);
+    CPU_SET(0, &affinity_allowed);
+  }
+  for (role = 0; role < AFFINITY_NUM_ROLES; role++)
+    affinity_roles[role] = affinity_allowed;
+}
+
+/* Parse a CPU list like "0-3,8" into SET. Returns -1 if it is malformed */
+static int affinity_parse(char *list, cpu_set_t *set) {
+  char *end;
+  long first, last;
+
+  CPU_ZERO(set);
+  while (*list != '\0' && *list != '\n') {
+    first = last = strtol(list, &end, 10);
+    if (end == list || first < 0)
+      return -1;
+    if (*end == '-') {
+      list = end + 1;
+      last = strtol(list, &end, 10);
+      if (end == list || last < first)
+        return -1;
+    }
+    if (last >= CPU_SETSIZE)
+      return -1;
+    for (; first <= last; first++)
+      CPU_SET(first, set);
+
+    if (*end == ',')
+      end++;
+    else if (*end != '\0' && *end != '\n')
+      return -1;
+    list = end;
+  }
+  return 0;
+}
+
+int affinity_num_cpus(void) {
+  pthread_once(&affinity_once, affinity_init);
+  return CPU_COUNT(&affinity_allowed);
+}
+
+int affinity_set_cpus(int role, char *list) {
+  cpu_set_t cpus;
+
+  pthread_once(&affinity_once, affinity_init);
+  if (affinity_parse(list, &cpus) == -1)
+    return -1;
+  CPU_AND(&cpus, &cpus, &affinity_allowed);
+  if (CPU_COUNT(&cpus) == 0)
+    return -1;
+  affinity_roles[role] = cpus;
+  affinity_listed[role] = 1;
+  return 0;
+}
+
+int affinity_has_cpus(int role) {
+  return affinity_listed[role];
+}
+
+/* Find the nodes that have CPUs for both roles */
+static void affinity_find_nodes(void) {
+  char path[64], list[4096];
+  cpu_set_t cpus;
+  int id, role;
+
+  pthread_once(&affinity_once, affinity_init);
+  for (id = 0; affinity_numa && id < AFFINITY_MAX_NODES; id++) {
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", id);
+    FILE *file = fopen(path, "re");
+    if (file == NULL)
+      continue;
+    int found = fgets(list, sizeof(list), file) != NULL &&
+      affinity_parse(list, &cpus) == 0;
+    fclose(file);
+    if (!found)
+      continue;
+
+    int node = affinity_nodes_size;
+    affinity_nodes[node].id = id;
+    for (role = 0; role < AFFINITY_NUM_ROLES; role++) {
+      CPU_AND(&affinity_nodes[node].cpus[role], &cpus, &affinity_roles[role]);
+      if (CPU_COUNT(&affinity_nodes[node].cpus[role]) == 0)
+        break;
+    }
+    if (role == AFFINITY_NUM_ROLES)
+      affinity_nodes_size++;
+  }
+
+  if (affinity_nodes_size == 0) {
+    if (affinity_numa)
+      fprintf(stderr, "No NUMA node has CPUs for both workers and acceptors; "
+          "not grouping threads by node\n");
+    affinity_numa = 0;
+    affinity_nodes_size = 1;
+    for (role = 0; role < AFFINITY_NUM_ROLES; role++)
+      affinity_nodes[0].cpus[role] = affinity_roles[role];
+  }
+}
+
+int affinity_num_nodes(void) {
+  pthread_once(&affinity_nodes_once, affinity_find_nodes);
+  return affinity_nodes_size;
+}
+
+/* Keep the calling thread to CPUS */
+static int affinity_apply(cpu_set_t *cpus) {
+  int rc = pthread_setaffinity_np(pthread_self(), sizeof(*cpus), cpus);
+  if (rc != 0) {
+    fprintf(stderr, "Cannot pin thread: %s\n", strerror(rc));
+    return -1;
+  }
+  return 0;
+}
+
+int affinity_pin(int index) {
+  cpu_set_t *cpus, pinned;
+  int cpu;
+
+  int nodes = affinity_num_nodes();
+  affinity_current_node = index % nodes;
+  cpus = &affinity_nodes[affinity_current_node].cpus[AFFINITY_ACCEPTORS];
+
+  /* Find the CPU at position INDEX among the node's, wrapping around */
+  index = index / nodes % CPU_COUNT(cpus);
+  for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, cpus) && index-- == 0)
+      break;
+  }
+
+  CPU_ZERO(&pinned);
+  CPU_SET(cpu, &pinned);
+  return affinity_apply(&pinned);
+}
+
+int affinity_pin_worker(int node) {
+  affinity_current_node = node % affinity_num_nodes();
+  if (!affinity_numa && !affinity_listed[AFFINITY_WORKERS])
+    return 0;
+  return affinity_apply(&affinity_nodes[affinity_current_node].cpus[AFFINITY_WORKERS]);
+}
+
+int affinity_node(void) {
+  return affinity_current_node;
+}
+
+void affinity_prefer_node(int node) {
+  unsigned long mask[AFFINITY_MAX_NODES / (8 * sizeof(unsigned long)) + 1] = { 0 };
+  long rc;
+
+  if (!affinity_numa)
+    return;
+  if (node < 0) {
+    rc = syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+  } else {
+    int id = affinity_nodes[node % affinity_num_nodes()].id;
+    mask[id / (8 * sizeof(unsigned long))] |= 1UL << id % (8 * sizeof(unsigned long));
+    rc = syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, AFFINITY_MAX_NODES + 1);
+  }
+  if (rc == -1)
+    perror("Cannot set memory policy (ignoring)");
+}
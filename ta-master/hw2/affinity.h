@@ -0,0 +1,59 @@
+#ifndef __AFFINITY__
+#define __AFFINITY__
+
+/* AFFINITY pins threads to CPUs. CPUs are numbered by their position in
+ * the set the process is allowed to run on, so pinning still works under
+ * taskset or a cgroup cpuset.
+ *
+ * Workers and acceptors (accept loops and reactors) can each be kept to a
+ * list of CPUs. With NUMA grouping on, threads are also split by the node
+ * their CPUs are on, so each node runs its own listeners and workers and
+ * their memory comes from that node. */
+
+/* Nodes looked for under /sys/devices/system/node */
+#define AFFINITY_MAX_NODES 64
+
+enum affinity_role {
+  AFFINITY_WORKERS,
+  AFFINITY_ACCEPTORS,   // Accept loops and reactors
+  AFFINITY_NUM_ROLES
+};
+
+/* Whether threads are grouped by NUMA node; set before the server starts */
+extern int affinity_numa;
+
+/* Returns how many CPUs the process may run on. */
+int affinity_num_cpus(void);
+
+/* Keeps threads of ROLE to the CPUs in LIST, written as for taskset -c (for
+ * example "0-3,8"); unlike other indexes here these are the system's CPU
+ * numbers. Returns -1 if LIST is malformed or has no CPU the process may
+ * run on. */
+int affinity_set_cpus(int role, char *list);
+
+/* Returns whether a CPU list was given for ROLE. */
+int affinity_has_cpus(int role);
+
+/* Returns how many nodes threads are grouped by: those with CPUs for both
+ * roles while affinity_numa is set, otherwise 1. */
+int affinity_num_nodes(void);
+
+/* Pins the calling thread as the INDEX-th acceptor. Acceptors are spread
+ * over the nodes round robin, then over the acceptor CPUs of their node,
+ * one CPU each, wrapping around. Returns 0 on success. */
+int affinity_pin(int index);
+
+/* Pins the calling thread as a worker of NODE, free to run on any of the
+ * node's worker CPUs. Workers float when there is no worker CPU list and
+ * no NUMA grouping. Returns 0 on success. */
+int affinity_pin_worker(int node);
+
+/* Returns the node the calling thread was pinned on, or 0. */
+int affinity_node(void);
+
+/* Has memory the calling thread touches first come from NODE from now on,
+ * or from wherever the thread runs if NODE is -1. Does nothing without
+ * NUMA grouping. */
+void affinity_prefer_node(int node);
+
+#endif
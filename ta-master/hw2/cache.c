@@ -0,0 +1,290 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "utlist.h"
+
+#define CACHE_SHARDS 16
+#define CACHE_BUCKETS 1024
+
+/* Largest file worth keeping in memory; bigger ones go out with sendfile */
+#define CACHE_MAX_FILE_SIZE (1 << 20)
+
+/* Seconds between comparing a cached file with the one on disk */
+#define CACHE_REVALIDATE_INTERVAL 1
+
+typedef struct cache_shard {
+  pthread_mutex_t lock;
+  cache_entry_t *lru;
+  cache_entry_t *buckets[CACHE_BUCKETS];
+  size_t used;
+} cache_shard_t;
+
+static cache_shard_t *cache_shards;
+static size_t cache_shard_capacity;
+
+/* FNV-1a */
+static unsigned int cache_hash(char *key) {
+  unsigned int hash = 2166136261u;
+  while (*key) {
+    hash ^= (unsigned char) *key++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static cache_shard_t *cache_shard(unsigned int hash) {
+  return &cache_shards[hash % CACHE_SHARDS];
+}
+
+static cache_entry_t **cache_bucket(cache_shard_t *shard, unsigned int hash) {
+  return &shard->buckets[(hash / CACHE_SHARDS) % CACHE_BUCKETS];
+}
+
+/* Remove ENTRY from its shard's table and LRU list. Called with the lock held. */
+static void cache_unlink(cache_shard_t *shard, cache_entry_t *entry) {
+  cache_entry_t **link = cache_bucket(shard, entry->hash);
+  while (*link != entry)
+    link = &(*link)->chain;
+  *link = entry->chain;
+
+  DL_DELETE(shard->lru, entry);
+  shard->used -= entry->size;
+  entry->unlinked = 1;
+  if (entry->refs == 0)
+    free(entry);
+}
+
+void cache_init(size_t max_bytes) {
+  if (max_bytes == 0)
+    return;
+
+  if ((cache_shards = calloc(CACHE_SHARDS, sizeof(cache_shard_t))) == NULL) {
+    fprintf(stderr, "Error in creating cache: %s\n", strerror(errno));
+    return;
+  }
+  cache_shard_capacity = max_bytes / CACHE_SHARDS;
+
+  int i;
+  for (i = 0; i < CACHE_SHARDS; i++)
+    pthread_mutex_init(&cache_shards[i].lock, NULL);
+}
+
+int cache_accepts(size_t size) {
+  return cache_shards != NULL && size <= CACHE_MAX_FILE_SIZE &&
+    size <= cache_shard_capacity;
+}
+
+cache_entry_t *cache_lookup(char *key) {
+  if (cache_shards == NULL)
+    return NULL;
+
+  unsigned int hash = cache_hash(key);
+  cache_shard_t *shard = cache_shard(hash);
+  cache_entry_t *entry;
+  time_t now = time(NULL);
+
+  pthread_mutex_lock(&shard->lock);
+  for (entry = *cache_bucket(shard, hash); entry != NULL; entry = entry->chain) {
+    if (entry->hash == hash && strcmp(entry->key, key) == 0)
+      break;
+  }
+  if (entry == NULL) {
+    pthread_mutex_unlock(&shard->lock);
+    return NULL;
+  }
+
+  /* Move to the front of the LRU list */
+  DL_DELETE(shard->lru, entry);
+  DL_PREPEND(shard->lru, entry);
+  entry->refs++;
+
+  int revalidate = now - entry->checked >= CACHE_REVALIDATE_INTERVAL;
+  if (revalidate)
+    entry->checked = now;
+  pthread_mutex_unlock(&shard->lock);
+
+  if (!revalidate)
+    return entry;
+
+  /* Only one worker per interval gets here, and it stats outside the lock.
+   * Adding or removing a file changes its directory's mtime, so listings
+   * are checked the same way as files, just without the size. */
+  struct stat file_stat, source_stat;
+  if (stat(entry->file_name, &file_stat) == 0 && file_stat.st_ino == entry->ino &&
+      (entry->listing ? S_ISDIR(file_stat.st_mode) : S_ISREG(file_stat.st_mode) &&
+       file_stat.st_size == entry->file_size) &&
+      file_stat.st_mtim.tv_sec == entry->mtime.tv_sec &&
+      file_stat.st_mtim.tv_nsec == entry->mtime.tv_nsec &&
+      /* A precompressed copy is only good while its source is unchanged */
+      (entry->source_name == NULL || (stat(entry->source_name, &source_stat) == 0 &&
+       source_stat.st_mtim.tv_sec == entry->source_mtime.tv_sec &&
+       source_stat.st_mtim.tv_nsec == entry->source_mtime.tv_nsec)))
+    return entry;
+
+  pthread_mutex_lock(&shard->lock);
+  if (!entry->unlinked)
+    cache_unlink(shard, entry);
+  pthread_mutex_unlock(&shard->lock);
+  cache_release(entry);
+  return NULL;
+}
+
+/* Allocate an entry for SIZE bytes of content; the caller fills in data */
+static cache_entry_t *cache_entry_new(char *key, char *file_name, struct stat *file_stat,
+    char *mime_type, char *encoding, size_t size, int listing, char *source_name,
+    struct stat *source_stat) {
+  struct http_validators validators;
+  char headers[512];
+  int headers_len;
+
+  if (listing) {
+    headers_len = snprintf(headers, sizeof(headers),
+        "Content-Type: %s\r\nContent-Length: %zu\r\n", mime_type, size);
+  } else {
+    http_make_validators(&validators, file_stat->st_ino, file_stat->st_size,
+        &file_stat->st_mtim, encoding);
+    headers_len = snprintf(headers, sizeof(headers),
+        "Content-Type: %s\r\nContent-Length: %zu\r\nAccept-Ranges: bytes\r\n"
+        "%s%s%s%sETag: %s\r\nLast-Modified: %s\r\n", mime_type, size,
+        encoding ? "Content-Encoding: " : "", encoding ? encoding : "", encoding ? "\r\n" : "",
+        encoding || http_mime_compressible(mime_type) ? "Vary: Accept-Encoding\r\n" : "",
+        validators.etag, validators.last_modified);
+  }
+  size_t key_len = strlen(key), file_name_len = strlen(file_name);
+  size_t source_name_len = source_name != NULL ? strlen(source_name) : 0;
+
+  /* One allocation for the entry, its strings and the content */
+  cache_entry_t *entry = malloc(sizeof(cache_entry_t) + key_len + 1 +
+      file_name_len + 1 + source_name_len + 1 + headers_len + 1 + size);
+  if (entry == NULL)
+    return NULL;
+  entry->key = (char *) (entry + 1);
+  entry->file_name = entry->key + key_len + 1;
+  entry->headers = entry->file_name + file_name_len + 1 + source_name_len + 1;
+  entry->data = entry->headers + headers_len + 1;
+  memcpy(entry->key, key, key_len + 1);
+  memcpy(entry->file_name, file_name, file_name_len + 1);
+  memcpy(entry->headers, headers, headers_len + 1);
+  entry->source_name = NULL;
+  if (source_name != NULL) {
+    entry->source_name = entry->file_name + file_name_len + 1;
+    memcpy(entry->source_name, source_name, source_name_len + 1);
+    entry->source_mtime = source_stat->st_mtim;
+  }
+  entry->headers_len = headers_len;
+  entry->size = size;
+  entry->mime_type = mime_type;
+  entry->encoding = encoding;
+  entry->listing = listing;
+  entry->incompressible = 0;
+  if (!listing)
+    entry->validators = validators;
+
+  entry->mtime = file_stat->st_mtim;
+  entry->ino = file_stat->st_ino;
+  entry->file_size = file_stat->st_size;
+  entry->checked = time(NULL);
+  entry->refs = 1;
+  entry->unlinked = 0;
+  entry->hash = cache_hash(key);
+  return entry;
+}
+
+/* Make a new entry visible, replacing any older one for the same key */
+static cache_entry_t *cache_add(cache_entry_t *entry) {
+  cache_shard_t *shard = cache_shard(entry->hash);
+  cache_entry_t **bucket = cache_bucket(shard, entry->hash);
+  cache_entry_t *old;
+
+  pthread_mutex_lock(&shard->lock);
+  /* Another worker may have cached the same path meanwhile; replace it */
+  for (old = *bucket; old != NULL; old = old->chain) {
+    if (old->hash == entry->hash && strcmp(old->key, entry->key) == 0) {
+      cache_unlink(shard, old);
+      break;
+    }
+  }
+  /* Evict least recently used entries until the new one fits */
+  while (shard->lru != NULL && shard->used + entry->size > cache_shard_capacity)
+    cache_unlink(shard, shard->lru->prev);
+
+  entry->chain = *bucket;
+  *bucket = entry;
+  DL_PREPEND(shard->lru, entry);
+  shard->used += entry->size;
+  pthread_mutex_unlock(&shard->lock);
+
+  return entry;
+}
+
+cache_entry_t *cache_insert(char *key, char *file_name, int file_fd,
+    struct stat *file_stat, char *mime_type, char *encoding, char *source_name,
+    struct stat *source_stat) {
+  size_t size = file_stat->st_size;
+  if (!cache_accepts(size))
+    return NULL;
+
+  cache_entry_t *entry = cache_entry_new(key, file_name, file_stat, mime_type, encoding,
+      size, 0, source_name, source_stat);
+  if (entry == NULL)
+    return NULL;
+
+  size_t offset = 0;
+  while (offset < size) {
+    ssize_t bytes_read = pread(file_fd, entry->data + offset, size - offset, offset);
+    if (bytes_read < 0 && errno == EINTR)
+      continue;
+    if (bytes_read <= 0) {
+      free(entry);
+      return NULL;
+    }
+    offset += bytes_read;
+  }
+
+  return cache_add(entry);
+}
+
+cache_entry_t *cache_insert_data(char *key, char *file_name, struct stat *file_stat,
+    char *mime_type, char *encoding, char *data, size_t size) {
+  if (!cache_accepts(size))
+    return NULL;
+
+  cache_entry_t *entry = cache_entry_new(key, file_name, file_stat, mime_type, encoding,
+      size, 0, NULL, NULL);
+  if (entry == NULL)
+    return NULL;
+  memcpy(entry->data, data, size);
+
+  return cache_add(entry);
+}
+
+cache_entry_t *cache_insert_listing(char *key, char *dir_name, struct stat *dir_stat,
+    char *html, size_t size) {
+  if (!cache_accepts(size))
+    return NULL;
+
+  cache_entry_t *entry = cache_entry_new(key, dir_name, dir_stat, "text/html", NULL,
+      size, 1, NULL, NULL);
+  if (entry == NULL)
+    return NULL;
+  memcpy(entry->data, html, size);
+
+  return cache_add(entry);
+}
+
+void cache_release(cache_entry_t *entry) {
+  cache_shard_t *shard = cache_shard(entry->hash);
+  int dead;
+
+  pthread_mutex_lock(&shard->lock);
+  dead = --entry->refs == 0 && entry->unlinked;
+  pthread_mutex_unlock(&shard->lock);
+
+  if (dead)
+    free(entry);
+}
@@ -0,0 +1,82 @@
+#ifndef __CACHE__
+#define __CACHE__
+
+#include <stddef.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "libhttp.h"
+
+/* CACHE keeps the contents of small, frequently requested files in memory,
+ * together with their ready-made Content-Type/Content-Length headers. It is
+ * split into shards, each with its own lock and LRU list, so workers rarely
+ * contend. Entries are keyed by the full path the request resolved to.
+ * Rendered directory listings are cached the same way and dropped when the
+ * directory's mtime changes, and so are gzip copies of files, under their own
+ * keys. */
+
+typedef struct cache_entry {
+  char *key;
+  char *file_name;        // File the content came from (may be an index.html)
+  char *source_name;      // What file_name was precompressed from, or NULL
+  char *mime_type;        // From http_get_mime_type, never freed
+  char *encoding;         // Content-Encoding of data, or NULL; never freed
+  char *headers;          // "Content-Type: ...\r\nContent-Length: ...\r\n" and more
+  size_t headers_len;
+  char *data;
+  size_t size;
+
+  struct timespec mtime;  // Validators of the cached copy
+  ino_t ino;
+  off_t file_size;        // Of file_name, which data may be a compressed copy of
+  struct timespec source_mtime;  // Of source_name, if any
+  time_t checked;         // Last time the validators were compared with disk
+  int listing;            // A rendered listing of the directory file_name
+  int incompressible;     // Gzip didn't make it smaller; gzip clients get it as is
+  struct http_validators validators;  // Of the file; unset for listings
+
+  int refs;               // Workers still sending this entry
+  int unlinked;           // Evicted or stale; freed on the last release
+  unsigned int hash;
+  struct cache_entry *next;   // LRU list, most recently used first
+  struct cache_entry *prev;
+  struct cache_entry *chain;  // Hash bucket
+} cache_entry_t;
+
+/* Sets up a cache holding at most MAX_BYTES of file data. 0 disables it. */
+void cache_init(size_t max_bytes);
+
+/* Whether a file of SIZE bytes may be cached at all. */
+int cache_accepts(size_t size);
+
+/* Returns the entry for KEY with a reference held, or NULL. Entries are
+ * compared with the file on disk (and the file it was precompressed from)
+ * at most once a second and dropped if it has changed. */
+cache_entry_t *cache_lookup(char *key);
+
+/* Reads the open file FILE_FD (described by FILE_STAT) into the cache under
+ * KEY. ENCODING is the file's Content-Encoding, if it is stored compressed;
+ * it is then a precompressed copy of SOURCE_NAME (described by SOURCE_STAT),
+ * and goes stale as soon as that changes. Returns the new entry with a
+ * reference held, or NULL if it couldn't be cached. */
+cache_entry_t *cache_insert(char *key, char *file_name, int file_fd,
+    struct stat *file_stat, char *mime_type, char *encoding, char *source_name,
+    struct stat *source_stat);
+
+/* Caches SIZE bytes of DATA under KEY, a copy of the file FILE_NAME
+ * (described by FILE_STAT) in ENCODING, such as the file compressed on the
+ * fly. Returns the new entry with a reference held, or NULL if it couldn't
+ * be cached. */
+cache_entry_t *cache_insert_data(char *key, char *file_name, struct stat *file_stat,
+    char *mime_type, char *encoding, char *data, size_t size);
+
+/* Caches SIZE bytes of HTML listing the directory DIR_NAME (described by
+ * DIR_STAT, taken before the listing was rendered) under KEY. Returns the new
+ * entry with a reference held, or NULL if it couldn't be cached. */
+cache_entry_t *cache_insert_listing(char *key, char *dir_name, struct stat *dir_stat,
+    char *html, size_t size);
+
+/* Drops a reference returned by cache_lookup or cache_insert. */
+void cache_release(cache_entry_t *entry);
+
+#endif
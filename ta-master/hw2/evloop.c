@@ -0,0 +1,248 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "affinity.h"
+#include "evloop.h"
+#include "libhttp.h"
+#include "utlist.h"
+
+#define EVLOOP_MAX_EVENTS 256
+
+/* Bookkeeping for a connection waiting in a reactor, indexed by fd */
+typedef struct evloop_slot {
+  int fd;
+  struct reactor *reactor;
+  time_t deadline;              // When to give up on the next request
+  int waiting;                  // On the reactor's idle list
+  struct evloop_slot *next;
+  struct evloop_slot *prev;
+} evloop_slot_t;
+
+struct reactor {
+  int epoll_fd;
+  int server_fd;
+  int cpu;                      // CPU to run on, or -1 to float
+  void (*dispatch)(int);
+  pthread_mutex_t lock;         // Protects idle, which workers append to
+  evloop_slot_t *idle;          // Waiting connections, oldest deadline first
+};
+
+static evloop_slot_t *evloop_slots;
+static size_t evloop_slots_size;
+
+/* Start the idle clock for FD and arm it for the next read */
+static int reactor_watch(struct reactor *reactor, int fd, int op) {
+  evloop_slot_t *slot = &evloop_slots[fd];
+
+  pthread_mutex_lock(&reactor->lock);
+  if (!slot->waiting) {
+    slot->fd = fd;
+    slot->reactor = reactor;
+    slot->deadline = time(NULL) + (http_keep_alive_timeout > 0 ?
+        http_keep_alive_timeout : LIBHTTP_REQUEST_TIMEOUT);
+    slot->waiting = 1;
+    DL_APPEND(reactor->idle, slot);
+  }
+  pthread_mutex_unlock(&reactor->lock);
+
+  struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT, .data.fd = fd };
+  return epoll_ctl(reactor->epoll_fd, op, fd, &ev);
+}
+
+/* Stop the idle clock for FD */
+static void reactor_unwatch(struct reactor *reactor, int fd) {
+  evloop_slot_t *slot = &evloop_slots[fd];
+
+  pthread_mutex_lock(&reactor->lock);
+  if (slot->waiting) {
+    DL_DELETE(reactor->idle, slot);
+    slot->waiting = 0;
+  }
+  pthread_mutex_unlock(&reactor->lock);
+}
+
+/* Close connections that have waited too long for a request */
+static void reactor_expire(struct reactor *reactor) {
+  time_t now = time(NULL);
+
+  pthread_mutex_lock(&reactor->lock);
+  while (reactor->idle != NULL && reactor->idle->deadline <= now) {
+    evloop_slot_t *slot = reactor->idle;
+    DL_DELETE(reactor->idle, slot);
+    slot->waiting = 0;
+    http_close(slot->fd);
+  }
+  pthread_mutex_unlock(&reactor->lock);
+}
+
+/* Accept every pending connection and start watching it for input */
+static void reactor_accept(struct reactor *reactor) {
+  while (1) {
+    struct sockaddr_in peer;
+    socklen_t peer_len = sizeof(peer);
+    int fd = accept4(reactor->server_fd, (struct sockaddr *) &peer, &peer_len,
+        SOCK_NONBLOCK | SOCK_CLOEXEC);
+    struct http_conn *conn;
+    if (fd < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != ECONNABORTED)
+        perror("Error accepting socket");
+      return;
+    }
+
+    if ((size_t) fd >= evloop_slots_size || (conn = http_conn_get(fd)) == NULL) {
+      close(fd);
+      continue;
+    }
+    conn->peer = peer;
+
+    if (reactor_watch(reactor, fd, EPOLL_CTL_ADD) == -1) {
+      fprintf(stderr, "epoll_ctl - client fd: %s\n", strerror(errno));
+      reactor_unwatch(reactor, fd);
+      http_close(fd);
+    }
+  }
+}
+
+/* Read whatever the client has sent so far */
+static void reactor_read(struct reactor *reactor, int fd) {
+  struct http_conn *conn = http_conn_get(fd);
+  ssize_t bytes_read;
+  int ready;
+
+  while ((ready = http_conn_ready(conn)) == 0) {
+    bytes_read = http_conn_fill(conn);
+    if (bytes_read < 0 && errno == EAGAIN) {
+      /* Wait for the rest of the request, on the same deadline */
+      if (reactor_watch(reactor, fd, EPOLL_CTL_MOD) == -1) {
+        reactor_unwatch(reactor, fd);
+        http_close(fd);
+      }
+      return;
+    }
+    if (bytes_read <= 0) {
+      reactor_unwatch(reactor, fd);
+      http_close(fd);
+      return;
+    }
+  }
+
+  reactor_unwatch(reactor, fd);
+  if (ready < 0) {
+    http_reject(conn);
+    http_close(fd);
+    return;
+  }
+
+  /* EPOLLONESHOT leaves the fd disarmed, so it is the worker's now */
+  reactor->dispatch(fd);
+}
+
+static void *reactor_loop(void *arg) {
+  struct reactor *reactor = arg;
+  struct epoll_event events[EVLOOP_MAX_EVENTS];
+
+  if (reactor->cpu >= 0)
+    affinity_pin(reactor->cpu);
+
+  while (1) {
+    /* Wake up every second to expire idle connections; workers hand
+     * connections back without waking us */
+    int nfds = epoll_wait(reactor->epoll_fd, events, EVLOOP_MAX_EVENTS, 1000);
+    if (nfds == -1) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "Error in epoll wait: %s\n", strerror(errno));
+      exit(errno);
+    }
+
+    int n;
+    for (n = 0; n < nfds; n++) {
+      if (events[n].data.fd == reactor->server_fd)
+        reactor_accept(reactor);
+      else
+        reactor_read(reactor, events[n].data.fd);
+    }
+    reactor_expire(reactor);
+  }
+
+  return NULL;
+}
+
+void evloop_run(int *server_fds, int num_listeners, int num_reactors, void (*dispatch)(int)) {
+  /* Every listener needs at least one reactor accepting on it */
+  if (num_reactors < num_listeners)
+    num_reactors = num_listeners;
+
+  int i;
+  for (i = 0; i < num_listeners; i++) {
+    int flags = fcntl(server_fds[i], F_GETFL, 0);
+    if (flags == -1 || fcntl(server_fds[i], F_SETFL, flags | O_NONBLOCK) == -1) {
+      perror("Failed to make server socket non blocking");
+      exit(errno);
+    }
+  }
+
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == -1 || limit.rlim_cur == RLIM_INFINITY)
+    limit.rlim_cur = 65536;
+  evloop_slots_size = limit.rlim_cur;
+  evloop_slots = calloc(evloop_slots_size, sizeof(evloop_slot_t));
+
+  struct reactor *reactors = calloc(num_reactors, sizeof(struct reactor));
+  if (reactors == NULL || evloop_slots == NULL) {
+    fprintf(stderr, "%s\n", strerror(errno));
+    exit(ENOMEM);
+  }
+
+  for (i = 0; i < num_reactors; i++) {
+    /* With one listener per CPU each reactor stays next to its own queue */
+    int server_fd = server_fds[i % num_listeners];
+    reactors[i].server_fd = server_fd;
+    reactors[i].cpu = num_listeners > 1 || affinity_has_cpus(AFFINITY_ACCEPTORS) ? i : -1;
+    reactors[i].dispatch = dispatch;
+    pthread_mutex_init(&reactors[i].lock, NULL);
+    if ((reactors[i].epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+      perror("epoll_create1");
+      exit(errno);
+    }
+
+    /* Reactors sharing a listener use EPOLLEXCLUSIVE so only one wakes */
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.fd = server_fd };
+    if (epoll_ctl(reactors[i].epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) == -1) {
+      perror("epoll_ctl - server fd");
+      exit(errno);
+    }
+  }
+
+  for (i = 1; i < num_reactors; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, reactor_loop, &reactors[i]) != 0) {
+      fprintf(stderr, "Error in reactor creation: %s\n", strerror(errno));
+      exit(1);
+    }
+    pthread_detach(thread);
+  }
+
+  reactor_loop(&reactors[0]);
+}
+
+void evloop_resume(int fd) {
+  struct reactor *reactor = evloop_slots[fd].reactor;
+  if (reactor_watch(reactor, fd, EPOLL_CTL_MOD) == -1) {
+    reactor_unwatch(reactor, fd);
+    http_close(fd);
+  }
+}
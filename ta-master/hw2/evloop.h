@@ -0,0 +1,22 @@
+#ifndef __EVLOOP__
+#define __EVLOOP__
+
+/* EVLOOP runs epoll reactors that own accepting and reading client sockets.
+ * A connection is handed to the dispatch function only once a complete
+ * request head has been buffered (see http_conn_ready), so slow clients never
+ * hold a worker thread while they trickle in their request. */
+
+/* Runs NUM_REACTORS reactors accepting on the NUM_LISTENERS listening
+ * sockets in SERVER_FDS, spread round robin, with at least one reactor per
+ * listener. With several (SO_REUSEPORT) listeners or acceptor CPUs given,
+ * each reactor is pinned to its own CPU (see affinity_pin). DISPATCH is
+ * called with the client fd of every fully read request; the callee owns
+ * the fd from then on. Never returns. */
+void evloop_run(int *server_fds, int num_listeners, int num_reactors, void (*dispatch)(int));
+
+/* Gives a kept-alive connection back to the reactor that dispatched it, to
+ * wait for the next request. Connections that stay idle for longer than
+ * http_keep_alive_timeout are closed by the reactor. */
+void evloop_resume(int fd);
+
+#endif
@@ -0,0 +1,504 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "fileio.h"
+#include "libhttp.h"
+#include "utlist.h"
+
+/* Submission queue entries; every transfer has at most one operation in
+ * flight, plus the read of the wakeup eventfd */
+#define FILEIO_RING_SIZE (2 * FILEIO_MAX_TRANSFERS)
+
+/* What a transfer is waiting for */
+enum fileio_op {
+  FILEIO_READ,
+  FILEIO_SEND,
+  FILEIO_POLL
+};
+
+struct fileio_transfer {
+  int fd;             // Client socket
+  int file_fd;        // Our own descriptor of the file
+  off_t offset;       // Next byte of the file to read
+  size_t remaining;   // Bytes of the file still to read
+  char *buf;          // The head, then each chunk of the file
+  size_t len;         // Bytes in buf
+  size_t sent;        // Bytes of buf already sent
+  int op;
+  struct fileio_transfer *next;
+  struct fileio_transfer *prev;
+};
+
+/* The io_uring, as mapped from the kernel */
+struct fileio_ring {
+  int fd;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  unsigned to_submit;
+};
+
+static int fileio_mode;
+static void (*fileio_resume)(int fd, int ok);
+static int fileio_nowait_unsupported;
+
+static pthread_mutex_t fileio_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fileio_cond = PTHREAD_COND_INITIALIZER;
+static struct fileio_transfer *fileio_pending;    // Submitted, not yet started
+static int fileio_wake_fd;                        // Signalled on submission (io_uring)
+
+/* Buffers of finished transfers, reused for new ones */
+static struct fileio_transfer *fileio_spare[FILEIO_SPARE_BUFFERS];
+static int fileio_spare_len;
+
+static struct fileio_ring fileio_ring;
+static struct fileio_transfer *fileio_running;    // Transfers on the ring
+static int fileio_active;
+
+static __thread struct fileio_transfer *fileio_submitted;
+
+int fileio_cold(int file_fd, off_t offset, size_t length) {
+  char byte;
+  struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+
+  if (__atomic_load_n(&fileio_mode, __ATOMIC_RELAXED) == FILEIO_OFF || length == 0 ||
+      fileio_nowait_unsupported)
+    return 0;
+
+  /* Readahead brings files in whole, so their ends tell */
+  if (preadv2(file_fd, &iov, 1, offset, RWF_NOWAIT) == -1 ||
+      (length > 1 && preadv2(file_fd, &iov, 1, offset + length - 1, RWF_NOWAIT) == -1)) {
+    if (errno == EAGAIN)
+      return 1;
+    if (errno == EOPNOTSUPP || errno == ENOSYS || errno == EINVAL)
+      fileio_nowait_unsupported = 1;
+  }
+  return 0;
+}
+
+int fileio_submit(int fd, int file_fd, off_t offset, size_t length) {
+  struct http_conn *conn = http_conn_get(fd);
+  struct fileio_transfer *transfer;
+
+  if (__atomic_load_n(&fileio_mode, __ATOMIC_RELAXED) == FILEIO_OFF || conn == NULL ||
+      fileio_submitted != NULL)
+    return -1;
+
+  pthread_mutex_lock(&fileio_lock);
+  transfer = fileio_spare_len > 0 ? fileio_spare[--fileio_spare_len] : NULL;
+  pthread_mutex_unlock(&fileio_lock);
+  if (transfer == NULL && (transfer = malloc(sizeof(struct fileio_transfer) +
+          LIBHTTP_RESPONSE_HEAD_SIZE + FILEIO_CHUNK_SIZE)) == NULL)
+    return -1;
+  /* The caller's descriptor may be closed before we are done */
+  if ((transfer->file_fd = fcntl(file_fd, F_DUPFD_CLOEXEC, 0)) == -1) {
+    free(transfer);
+    return -1;
+  }
+
+  transfer->fd = fd;
+  transfer->offset = offset;
+  transfer->remaining = length;
+  transfer->buf = (char *) (transfer + 1);
+  memcpy(transfer->buf, conn->head, conn->head_len);
+  transfer->len = conn->head_len;
+  transfer->sent = 0;
+  conn->head_len = 0;
+  /* Counted now, since the response is logged before it is out */
+  conn->bytes_sent += transfer->len + length;
+
+  fileio_submitted = transfer;
+  return 0;
+}
+
+static void fileio_finish(struct fileio_transfer *transfer, int ok);
+
+int fileio_flush(void) {
+  struct fileio_transfer *transfer = fileio_submitted;
+  if (transfer == NULL)
+    return 0;
+  fileio_submitted = NULL;
+
+  pthread_mutex_lock(&fileio_lock);
+  int mode = fileio_mode;
+  if (mode != FILEIO_OFF)
+    LL_APPEND(fileio_pending, transfer);
+  pthread_mutex_unlock(&fileio_lock);
+
+  /* The io_uring failed since the transfer was handed over */
+  if (mode == FILEIO_OFF) {
+    fileio_finish(transfer, 0);
+  } else if (mode == FILEIO_URING) {
+    uint64_t one = 1;
+    if (write(fileio_wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+      perror("Error waking disk I/O thread");
+  } else {
+    pthread_cond_signal(&fileio_cond);
+  }
+  return 1;
+}
+
+static void fileio_finish(struct fileio_transfer *transfer, int ok) {
+  close(transfer->file_fd);
+  fileio_resume(transfer->fd, ok);
+
+  pthread_mutex_lock(&fileio_lock);
+  if (fileio_spare_len < FILEIO_SPARE_BUFFERS) {
+    fileio_spare[fileio_spare_len++] = transfer;
+    transfer = NULL;
+  }
+  pthread_mutex_unlock(&fileio_lock);
+  free(transfer);
+}
+
+/* Bytes the next read should ask for; the first one lands behind the head */
+static size_t fileio_read_size(struct fileio_transfer *transfer) {
+  size_t space = LIBHTTP_RESPONSE_HEAD_SIZE + FILEIO_CHUNK_SIZE - transfer->len;
+  if (space > FILEIO_CHUNK_SIZE)
+    space = FILEIO_CHUNK_SIZE;
+  return transfer->remaining < space ? transfer->remaining : space;
+}
+
+/* Account for BYTES read into the buffer */
+static void fileio_read_done(struct fileio_transfer *transfer, size_t bytes) {
+  transfer->len += bytes;
+  transfer->offset += bytes;
+  transfer->remaining -= bytes;
+}
+
+/* Append the next chunk of the file to the buffer, blocking */
+static int fileio_pread(struct fileio_transfer *transfer) {
+  ssize_t bytes;
+  while ((bytes = pread(transfer->file_fd, transfer->buf + transfer->len,
+          fileio_read_size(transfer), transfer->offset)) < 0 && errno == EINTR)
+    ;
+  /* The file got shorter after we sent Content-Length */
+  if (bytes <= 0)
+    return -1;
+  fileio_read_done(transfer, bytes);
+  return 0;
+}
+
+/* Blocking fallback: each thread sends one response at a time */
+static int fileio_copy(struct fileio_transfer *transfer) {
+  /* The first chunk goes out together with the head */
+  if (transfer->remaining > 0 && fileio_pread(transfer) == -1)
+    return -1;
+
+  while (transfer->sent < transfer->len) {
+    ssize_t bytes = send(transfer->fd, transfer->buf + transfer->sent,
+        transfer->len - transfer->sent, MSG_NOSIGNAL);
+    if (bytes < 0 && errno == EINTR)
+      continue;
+    if (bytes < 0 && errno == EAGAIN) {
+      if (http_wait_writable(transfer->fd) == -1)
+        return -1;
+      continue;
+    }
+    if (bytes < 0)
+      return -1;
+
+    transfer->sent += bytes;
+    if (transfer->sent == transfer->len && transfer->remaining > 0) {
+      transfer->len = transfer->sent = 0;
+      if (fileio_pread(transfer) == -1)
+        return -1;
+    }
+  }
+  return 0;
+}
+
+static void *fileio_thread_loop(void *arg) {
+  while (1) {
+    pthread_mutex_lock(&fileio_lock);
+    while (fileio_pending == NULL)
+      pthread_cond_wait(&fileio_cond, &fileio_lock);
+    struct fileio_transfer *transfer = fileio_pending;
+    LL_DELETE(fileio_pending, transfer);
+    pthread_mutex_unlock(&fileio_lock);
+
+    fileio_finish(transfer, fileio_copy(transfer) == 0);
+  }
+  return NULL;
+}
+
+/* Queue an operation on the ring; it is submitted with the next wait */
+static void fileio_queue(int opcode, int fd, void *addr, unsigned len, off_t offset,
+    struct fileio_transfer *transfer) {
+  struct fileio_ring *ring = &fileio_ring;
+  unsigned tail = *ring->sq_tail, index = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t) addr;
+  sqe->len = len;
+  sqe->off = offset;
+  sqe->user_data = (uintptr_t) transfer;
+  if (opcode == IORING_OP_SEND)
+    sqe->msg_flags = MSG_NOSIGNAL;
+  else if (opcode == IORING_OP_POLL_ADD)
+    sqe->poll32_events = POLLOUT;
+
+  ring->sq_array[index] = index;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->to_submit++;
+}
+
+static void fileio_read(struct fileio_transfer *transfer) {
+  transfer->op = FILEIO_READ;
+  fileio_queue(IORING_OP_READ, transfer->file_fd, transfer->buf + transfer->len,
+      fileio_read_size(transfer), transfer->offset, transfer);
+}
+
+static void fileio_send(struct fileio_transfer *transfer) {
+  transfer->op = FILEIO_SEND;
+  fileio_queue(IORING_OP_SEND, transfer->fd, transfer->buf + transfer->sent,
+      transfer->len - transfer->sent, 0, transfer);
+}
+
+static void fileio_start(struct fileio_transfer *transfer) {
+  DL_APPEND(fileio_running, transfer);
+  fileio_active++;
+  /* The first chunk goes out together with the head */
+  if (transfer->remaining > 0)
+    fileio_read(transfer);
+  else
+    fileio_send(transfer);
+}
+
+static void fileio_end(struct fileio_transfer *transfer, int ok) {
+  DL_DELETE(fileio_running, transfer);
+  fileio_active--;
+  fileio_finish(transfer, ok);
+}
+
+/* Give up on the io_uring after an error it can't recover from: fail every
+ * transfer on it or waiting for it, and take no more */
+static void fileio_ring_stop(void) {
+  struct fileio_transfer *transfer, *tmp;
+
+  pthread_mutex_lock(&fileio_lock);
+  __atomic_store_n(&fileio_mode, FILEIO_OFF, __ATOMIC_RELAXED);
+  struct fileio_transfer *pending = fileio_pending;
+  fileio_pending = NULL;
+  pthread_mutex_unlock(&fileio_lock);
+
+  close(fileio_ring.fd);
+  LL_FOREACH_SAFE(pending, transfer, tmp)
+    fileio_finish(transfer, 0);
+  /* The kernel may still be cancelling their operations, so their buffers
+   * are never reused */
+  DL_FOREACH_SAFE(fileio_running, transfer, tmp) {
+    DL_DELETE(fileio_running, transfer);
+    close(transfer->file_fd);
+    fileio_resume(transfer->fd, 0);
+  }
+  fileio_active = 0;
+}
+
+/* Take the next step of TRANSFER, whose operation returned RESULT */
+static void fileio_complete(struct fileio_transfer *transfer, int result) {
+  if (result == -EINTR || (result == -EAGAIN && transfer->op != FILEIO_SEND)) {
+    if (transfer->op == FILEIO_READ)
+      fileio_read(transfer);
+    else
+      fileio_send(transfer);
+    return;
+  }
+
+  switch (transfer->op) {
+    case FILEIO_READ:
+      /* The file got shorter after we sent Content-Length */
+      if (result <= 0) {
+        fileio_end(transfer, 0);
+        return;
+      }
+      fileio_read_done(transfer, result);
+      fileio_send(transfer);
+      break;
+    case FILEIO_SEND:
+      /* A non-blocking socket that is full; wait until it drains */
+      if (result == -EAGAIN) {
+        transfer->op = FILEIO_POLL;
+        fileio_queue(IORING_OP_POLL_ADD, transfer->fd, NULL, 0, 0, transfer);
+        return;
+      }
+      if (result < 0) {
+        fileio_end(transfer, 0);
+        return;
+      }
+      transfer->sent += result;
+      if (transfer->sent < transfer->len) {
+        fileio_send(transfer);
+      } else if (transfer->remaining > 0) {
+        transfer->len = transfer->sent = 0;
+        fileio_read(transfer);
+      } else {
+        fileio_end(transfer, 1);
+      }
+      break;
+    case FILEIO_POLL:
+      if (result < 0)
+        fileio_end(transfer, 0);
+      else
+        fileio_send(transfer);
+      break;
+  }
+}
+
+static void *fileio_uring_loop(void *arg) {
+  struct fileio_ring *ring = &fileio_ring;
+  uint64_t wakeups;
+
+  /* A completion with no transfer means something was submitted */
+  fileio_queue(IORING_OP_READ, fileio_wake_fd, &wakeups, sizeof(wakeups), -1, NULL);
+
+  while (1) {
+    int submitted = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 1,
+        IORING_ENTER_GETEVENTS, NULL, 0);
+    /* EAGAIN and EBUSY go away once completions are reaped */
+    if (submitted < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      perror("Error waiting for disk I/O; no longer sending cold files in the background");
+      fileio_ring_stop();
+      return NULL;
+    }
+    if (submitted > 0)
+      ring->to_submit -= submitted;
+
+    int woken = 0;
+    unsigned head = *ring->cq_head;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+      if (cqe->user_data == 0)
+        woken = 1;
+      else
+        fileio_complete((struct fileio_transfer *) (uintptr_t) cqe->user_data, cqe->res);
+      head++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    if (woken)
+      fileio_queue(IORING_OP_READ, fileio_wake_fd, &wakeups, sizeof(wakeups), -1, NULL);
+
+    /* Start what was submitted meanwhile, as far as there is room */
+    pthread_mutex_lock(&fileio_lock);
+    while (fileio_pending != NULL && fileio_active < FILEIO_MAX_TRANSFERS) {
+      struct fileio_transfer *transfer = fileio_pending;
+      LL_DELETE(fileio_pending, transfer);
+      fileio_start(transfer);
+    }
+    pthread_mutex_unlock(&fileio_lock);
+  }
+  return NULL;
+}
+
+/* Set up the io_uring and map its queues. Returns -1 if the kernel lacks it. */
+static int fileio_ring_init(void) {
+  struct fileio_ring *ring = &fileio_ring;
+  struct io_uring_params params;
+  void *sq, *cq;
+
+  memset(&params, 0, sizeof(params));
+  if ((ring->fd = syscall(__NR_io_uring_setup, FILEIO_RING_SIZE, &params)) == -1)
+    return -1;
+
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+
+  sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+      IORING_OFF_SQ_RING);
+  cq = (params.features & IORING_FEAT_SINGLE_MMAP) ? sq : mmap(NULL, cq_size,
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (sq == MAP_FAILED || cq == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    close(ring->fd);
+    return -1;
+  }
+
+  ring->sq_tail = (unsigned *) ((char *) sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *) ((char *) sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) ((char *) sq + params.sq_off.array);
+  ring->cq_head = (unsigned *) ((char *) cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *) ((char *) cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *) ((char *) cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) ((char *) cq + params.cq_off.cqes);
+  ring->to_submit = 0;
+
+  /* io_uring itself came before the operations we use (Linux 5.6) */
+  int ops[] = { IORING_OP_READ, IORING_OP_SEND, IORING_OP_POLL_ADD };
+  size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = calloc(1, probe_size);
+  size_t i;
+  int supported = probe != NULL &&
+    syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+  for (i = 0; supported && i < sizeof(ops) / sizeof(ops[0]); i++)
+    supported = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+  free(probe);
+  if (!supported) {
+    close(ring->fd);
+    errno = EOPNOTSUPP;
+    return -1;
+  }
+  return 0;
+}
+
+void fileio_init(int mode, int num_threads, void (*resume)(int fd, int ok)) {
+  pthread_t thread;
+  int i;
+
+  fileio_resume = resume;
+  if (mode == FILEIO_OFF)
+    return;
+
+  if (mode == FILEIO_URING) {
+    if ((fileio_wake_fd = eventfd(0, EFD_CLOEXEC)) == -1 || fileio_ring_init() == -1) {
+      perror("io_uring unavailable; reading cold files on threads");
+      if (fileio_wake_fd != -1)
+        close(fileio_wake_fd);
+      mode = FILEIO_THREADS;
+    } else if (pthread_create(&thread, NULL, fileio_uring_loop, NULL) != 0) {
+      fprintf(stderr, "Error in creating disk I/O thread: %s\n", strerror(errno));
+      return;
+    } else {
+      pthread_detach(thread);
+    }
+  }
+
+  if (mode == FILEIO_THREADS) {
+    for (i = 0; i < num_threads; i++) {
+      if (pthread_create(&thread, NULL, fileio_thread_loop, NULL) != 0) {
+        fprintf(stderr, "Error in creating disk I/O thread: %s\n", strerror(errno));
+        if (i == 0)
+          return;
+        break;
+      }
+      pthread_detach(thread);
+    }
+  }
+  fileio_mode = mode;
+}
@@ -0,0 +1,51 @@
+#ifndef __FILEIO__
+#define __FILEIO__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* FILEIO sends files that aren't in the page cache without holding a worker
+ * thread while the disk reads them. A worker that finds its file cold hands
+ * the rest of the response over and moves on to other connections; the
+ * file is read and sent in chunks in the background, and the connection is
+ * given back once the response is out.
+ *
+ * The background work runs on one thread driving an io_uring, which keeps
+ * many reads and sends in flight at once. Where io_uring is unavailable a
+ * few threads do the same with plain blocking calls, one response each. */
+
+/* Bytes read from the file and sent at a time */
+#define FILEIO_CHUNK_SIZE (256 * 1024)
+
+/* Responses the io_uring thread works on at once; more wait their turn */
+#define FILEIO_MAX_TRANSFERS 256
+
+/* Buffers of finished responses kept for the next ones */
+#define FILEIO_SPARE_BUFFERS 16
+
+enum fileio_mode {
+  FILEIO_OFF,
+  FILEIO_URING,       // io_uring, or FILEIO_THREADS if the kernel lacks it
+  FILEIO_THREADS
+};
+
+/* Starts FILEIO in MODE, with NUM_THREADS threads if it comes to blocking
+ * ones. RESUME is called from a FILEIO thread with each client socket once
+ * its response is out, OK being 0 if it could not be completed. */
+void fileio_init(int mode, int num_threads, void (*resume)(int fd, int ok));
+
+/* Whether reading LENGTH bytes of FILE_FD at OFFSET would wait for the disk.
+ * Always 0 while FILEIO is off. */
+int fileio_cold(int file_fd, off_t offset, size_t length);
+
+/* Hands over the rest of FD's response: its buffered head, then LENGTH bytes
+ * of FILE_FD at OFFSET. Nothing happens until the calling thread is done
+ * with the connection and calls fileio_flush. Returns -1, with the response
+ * still the caller's, if it couldn't be handed over. */
+int fileio_submit(int fd, int file_fd, off_t offset, size_t length);
+
+/* Starts the response handed over on this thread, if any. Returns 1 if
+ * there was one; its connection then belongs to FILEIO until RESUME. */
+int fileio_flush(void);
+
+#endif
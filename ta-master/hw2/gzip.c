@@ -0,0 +1,44 @@
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "gzip.h"
+
+/* Window bits for deflateInit2: the largest window, with a gzip wrapper */
+#define GZIP_WINDOW_BITS (15 + 16)
+#define GZIP_MEM_LEVEL 8
+
+char *gzip_compress(char *data, size_t size, int level, size_t *compressed_size) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  *compressed_size = 0;
+  if (deflateInit2(&stream, level, Z_DEFLATED, GZIP_WINDOW_BITS, GZIP_MEM_LEVEL,
+        Z_DEFAULT_STRATEGY) != Z_OK)
+    return NULL;
+
+  /* deflateBound leaves out the gzip header and trailer */
+  size_t bound = deflateBound(&stream, size) + 18;
+  char *compressed = malloc(bound);
+  if (compressed == NULL) {
+    deflateEnd(&stream);
+    return NULL;
+  }
+
+  stream.next_in = (Bytef *) data;
+  stream.avail_in = size;
+  stream.next_out = (Bytef *) compressed;
+  stream.avail_out = bound;
+  int rc = deflate(&stream, Z_FINISH);
+  deflateEnd(&stream);
+  if (rc != Z_STREAM_END) {
+    free(compressed);
+    return NULL;
+  }
+
+  *compressed_size = stream.total_out;
+  if (*compressed_size >= size) {
+    free(compressed);
+    return NULL;
+  }
+  return compressed;
+}
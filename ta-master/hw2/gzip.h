@@ -0,0 +1,15 @@
+#ifndef __GZIP__
+#define __GZIP__
+
+#include <stddef.h>
+
+/* GZIP compresses response bodies for clients that accept
+ * "Content-Encoding: gzip". */
+
+/* Compresses SIZE bytes of DATA at zlib LEVEL (1-9). Returns a malloc'd gzip
+ * stream and sets *COMPRESSED_SIZE, or returns NULL if compression failed or
+ * wouldn't make the body smaller. *COMPRESSED_SIZE is then 0 or what the
+ * body came to, so callers can tell the two apart. */
+char *gzip_compress(char *data, size_t size, int level, size_t *compressed_size);
+
+#endif
@@ -2,6 +2,7 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <pthread.h>
@@ -13,11 +14,20 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
-#include <sys/epoll.h>
 
 #include "libhttp.h"
 #include "wq.h"
 #include "thpool.h"
+#include "evloop.h"
+#include "cache.h"
+#include "upstream.h"
+#include "relay.h"
+#include "affinity.h"
+#include "gzip.h"
+#include "metrics.h"
+#include "accesslog.h"
+#include "pathcache.h"
+#include "fileio.h"
 
 /*
  * Global configuration variables.
@@ -27,12 +37,399 @@
  */
 wq_t work_queue;
 int num_threads;
+int min_threads;
 int server_port;
 char *server_files_directory;
 char *server_proxy_hostname;
 int server_proxy_port;
+int server_event_loop;
+int num_reactors = 1;
+int num_listeners = 1;
+size_t cache_size_mb = 64;
+size_t path_cache_size = 1024;
+int disk_io_mode = FILEIO_URING;
+int disk_threads = 4;
+int listing_cache = 1;
+int gzip_level = 6;
+char *access_log_path = NULL;
+size_t access_log_max_mb = 0;
+int proxy_preconnect = 8;
+int proxy_max_conns = 1024;
+int proxy_dns_ttl = 60;
+size_t proxy_chunk_kb = 256;
+int proxy_reactors = 1;
 
 
+/* Send a complete HTML response, so the connection can be reused after it */
+void send_html(int fd, int status_code, char *html) {
+  char con_len[32];
+  snprintf(con_len, sizeof(con_len), "%zu", strlen(html));
+
+  http_start_response(fd, status_code);
+  http_send_header(fd, "Content-Type", "text/html");
+  http_send_header(fd, "Content-Length", con_len);
+  http_end_headers(fd);
+  http_send_string(fd, html);
+}
+
+/* Answer a request http_request_parse rejected; say nothing if the client
+ * simply closed the connection */
+void send_error(int fd) {
+  struct http_conn *conn = http_conn_get(fd);
+  char html[128];
+
+  if (conn == NULL || conn->error == 0)
+    return;
+  snprintf(html, sizeof(html), "<center><h1>%d %s</h1><hr></center>",
+      conn->error, http_get_response_message(conn->error));
+  send_html(fd, conn->error, html);
+}
+
+/* Where the server answers with its own metrics, unless a file is there */
+char *metrics_path = "/metrics";
+
+/* Send every metric in the Prometheus text format */
+void send_metrics(int fd) {
+  char *body = NULL;
+  size_t size = 0;
+  char value[32];
+
+  FILE *out = open_memstream(&body, &size);
+  if (out == NULL) {
+    send_html(fd, 500, "<center><h1>500 Internal Server Error</h1><hr></center>");
+    return;
+  }
+  metrics_render(out);
+  if (num_threads > 0) {
+    fprintf(out, "# HELP httpserver_queue_length Connections waiting for a worker thread.\n"
+        "# TYPE httpserver_queue_length gauge\n"
+        "httpserver_queue_length %zu\n", work_queue_size());
+
+    thpool_stats_t stats;
+    thpool_stats(&stats);
+    fprintf(out, "# HELP httpserver_tasks_total Tasks run by worker threads, by where "
+        "they were found.\n# TYPE httpserver_tasks_total counter\n"
+        "httpserver_tasks_total{source=\"queue\"} %llu\n"
+        "httpserver_tasks_total{source=\"local\"} %llu\n"
+        "httpserver_tasks_total{source=\"stolen\"} %llu\n",
+        (unsigned long long) stats.queued, (unsigned long long) stats.local,
+        (unsigned long long) stats.stolen);
+  }
+  fclose(out);
+
+  http_start_response(fd, 200);
+  http_send_header(fd, "Content-Type", "text/plain; version=0.0.4");
+  snprintf(value, sizeof(value), "%zu", size);
+  http_send_header(fd, "Content-Length", value);
+  http_send_header(fd, "Cache-Control", "no-store");
+  http_end_headers(fd);
+  http_send_data(fd, body, size);
+  free(body);
+}
+
+/* Smaller files gain nothing from being compressed on the fly */
+#define GZIP_MIN_SIZE 256
+
+/* Appended to a path's cache key for its gzip copy; can't occur in a path */
+#define GZIP_KEY_SUFFIX "\ngzip"
+
+/* Send a file straight from the in-memory cache */
+void send_cache_entry(int fd, cache_entry_t *entry) {
+  http_start_response(fd, 200);
+  http_send_headers(fd, entry->headers, entry->headers_len);
+  http_end_headers(fd);
+  http_send_data(fd, entry->data, entry->size);
+}
+
+/* A file body to send: a cache entry, a compressed copy in memory, or an
+ * open file, in that order of preference */
+struct file_body {
+  cache_entry_t *entry;
+  char *data;
+  int file_fd;
+  char *mime_type;
+  char *encoding;       // Content-Encoding, or NULL
+  off_t size;
+  int cold;             // The file isn't in the page cache
+  struct http_validators validators;
+};
+
+void file_body_from_entry(struct file_body *body, cache_entry_t *entry) {
+  body->entry = entry;
+  body->data = NULL;
+  body->file_fd = -1;
+  body->mime_type = entry->mime_type;
+  body->encoding = entry->encoding;
+  body->size = entry->size;
+  body->cold = 0;
+  body->validators = entry->validators;
+}
+
+/* Send LENGTH bytes of the body at OFFSET */
+int send_body(int fd, struct file_body *body, off_t offset, size_t length) {
+  if (body->entry != NULL || body->data != NULL) {
+    http_send_data(fd, (body->entry ? body->entry->data : body->data) + offset, length);
+    return 0;
+  }
+  return http_send_file(fd, body->file_fd, offset, length);
+}
+
+/* Send the rest of the response: LENGTH bytes of the body at OFFSET. A cold
+ * file is left to FILEIO rather than hold the worker while the disk reads it. */
+int send_last_body(int fd, struct file_body *body, off_t offset, size_t length) {
+  if (body->cold && fileio_submit(fd, body->file_fd, offset, length) == 0)
+    return 0;
+  return send_body(fd, body, offset, length);
+}
+
+/* Separates the parts of a multi-range response */
+#define RANGE_BOUNDARY "httpserver-byteranges-5f1c9a"
+
+/* Header of one part of a multipart/byteranges body; returns its length */
+int format_range_part(char *part, size_t size, char *mime_type,
+    struct http_range *range, off_t file_size) {
+  return snprintf(part, size, "\r\n--" RANGE_BOUNDARY "\r\n"
+      "Content-Type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n", mime_type,
+      (long long) range->first, (long long) range->last, (long long) file_size);
+}
+
+/* Headers describing the whole file, sent with every part of it */
+void send_body_headers(int fd, struct file_body *body) {
+  http_send_header(fd, "Accept-Ranges", "bytes");
+  if (body->encoding != NULL)
+    http_send_header(fd, "Content-Encoding", body->encoding);
+  if (body->encoding != NULL || http_mime_compressible(body->mime_type))
+    http_send_header(fd, "Vary", "Accept-Encoding");
+  http_send_header(fd, "ETag", body->validators.etag);
+  http_send_header(fd, "Last-Modified", body->validators.last_modified);
+}
+
+/* Tell the client its copy is still good; nothing of the file is read */
+void send_not_modified(int fd, struct http_validators *validators) {
+  http_start_response(fd, 304);
+  http_send_header(fd, "ETag", validators->etag);
+  http_send_header(fd, "Last-Modified", validators->last_modified);
+  http_end_headers(fd);
+  http_flush(fd);
+}
+
+/*
+ * Answers with BODY: the whole file, or only the parts named in the
+ * request's Range header (206), or 416 if none of them exist. Parts of files
+ * on disk are sent straight from the file with sendfile at their offsets.
+ */
+void send_file(int fd, struct http_request *request, struct file_body *body) {
+  struct http_range ranges[LIBHTTP_MAX_RANGES];
+  char *range = http_get_header(request, "Range");
+  off_t size = body->size;
+  int count = -1;
+  char value[128];
+  int i, rc = 0;
+
+  if (range != NULL && http_if_range(request, &body->validators))
+    count = http_parse_ranges(range, size, ranges, LIBHTTP_MAX_RANGES);
+
+  if (count < 0 && body->entry != NULL) {
+    send_cache_entry(fd, body->entry);
+  } else if (count < 0) {
+    http_start_response(fd, 200);
+    http_send_header(fd, "Content-Type", body->mime_type);
+    snprintf(value, sizeof(value), "%lld", (long long) size);
+    http_send_header(fd, "Content-Length", value);
+    send_body_headers(fd, body);
+    http_end_headers(fd);
+    rc = send_last_body(fd, body, 0, size);
+  } else if (count == 0) {
+    http_start_response(fd, 416);
+    snprintf(value, sizeof(value), "bytes */%lld", (long long) size);
+    http_send_header(fd, "Content-Range", value);
+    http_send_header(fd, "Content-Length", "0");
+    http_end_headers(fd);
+    rc = http_flush(fd);
+  } else if (count == 1) {
+    http_start_response(fd, 206);
+    http_send_header(fd, "Content-Type", body->mime_type);
+    snprintf(value, sizeof(value), "bytes %lld-%lld/%lld", (long long) ranges[0].first,
+        (long long) ranges[0].last, (long long) size);
+    http_send_header(fd, "Content-Range", value);
+    snprintf(value, sizeof(value), "%lld", (long long) (ranges[0].last - ranges[0].first + 1));
+    http_send_header(fd, "Content-Length", value);
+    send_body_headers(fd, body);
+    http_end_headers(fd);
+    rc = send_last_body(fd, body, ranges[0].first, ranges[0].last - ranges[0].first + 1);
+  } else {
+    /* Every part gets its own header; the length covers all of them */
+    char part[256];
+    off_t length = sizeof("\r\n--" RANGE_BOUNDARY "--\r\n") - 1;
+    for (i = 0; i < count; i++) {
+      length += format_range_part(part, sizeof(part), body->mime_type, &ranges[i], size);
+      length += ranges[i].last - ranges[i].first + 1;
+    }
+
+    http_start_response(fd, 206);
+    http_send_header(fd, "Content-Type", "multipart/byteranges; boundary=" RANGE_BOUNDARY);
+    snprintf(value, sizeof(value), "%lld", (long long) length);
+    http_send_header(fd, "Content-Length", value);
+    send_body_headers(fd, body);
+    http_end_headers(fd);
+    for (i = 0; i < count && rc == 0; i++) {
+      int part_len = format_range_part(part, sizeof(part), body->mime_type, &ranges[i], size);
+      http_send_data(fd, part, part_len);
+      rc = send_body(fd, body, ranges[i].first, ranges[i].last - ranges[i].first + 1);
+    }
+    if (rc == 0)
+      http_send_string(fd, "\r\n--" RANGE_BOUNDARY "--\r\n");
+  }
+
+  if (rc < 0)
+    http_conn_get(fd)->keep_alive = 0;
+}
+
+/* Answer from a cache entry, or with 304 if the client has it already */
+void send_cached(int fd, struct http_request *request, cache_entry_t *entry) {
+  struct file_body body;
+
+  if (entry->listing) {
+    send_cache_entry(fd, entry);
+  } else if (http_not_modified(request, &entry->validators)) {
+    send_not_modified(fd, &entry->validators);
+  } else {
+    file_body_from_entry(&body, entry);
+    send_file(fd, request, &body);
+  }
+}
+
+/* Whether a file of SIZE bytes and MIME_TYPE gets compressed on the fly.
+ * Only files the cache keeps are, so each is compressed once per change. */
+int gzip_on_the_fly(char *mime_type, off_t size) {
+  return gzip_level > 0 && size >= GZIP_MIN_SIZE && cache_accepts(size) &&
+    http_mime_compressible(mime_type);
+}
+
+/* Compress the cached plain copy ENTRY and cache the result under GZIP_KEY.
+ * Returns the entry to send, with a reference held: the compressed copy, or
+ * ENTRY itself, marked so nobody tries again if compressing didn't help. */
+cache_entry_t *gzip_cached(cache_entry_t *entry, char *gzip_key) {
+  size_t compressed_size;
+  char *compressed = gzip_compress(entry->data, entry->size, gzip_level, &compressed_size);
+  if (compressed == NULL) {
+    /* Running out of memory is no reason to give up on the file for good */
+    if (compressed_size > 0)
+      __atomic_store_n(&entry->incompressible, 1, __ATOMIC_RELAXED);
+    return entry;
+  }
+
+  /* All the validators need from the file */
+  struct stat file_stat;
+  memset(&file_stat, 0, sizeof(file_stat));
+  file_stat.st_ino = entry->ino;
+  file_stat.st_size = entry->file_size;
+  file_stat.st_mtim = entry->mtime;
+  cache_entry_t *gzipped = cache_insert_data(gzip_key, entry->file_name, &file_stat,
+      entry->mime_type, "gzip", compressed, compressed_size);
+  free(compressed);
+  if (gzipped == NULL)
+    return entry;
+  cache_release(entry);
+  return gzipped;
+}
+
+/* Read all of FILE_FD and compress it; NULL if that failed or didn't help,
+ * told apart as by gzip_compress */
+char *gzip_file(int file_fd, size_t size, size_t *compressed_size) {
+  char *data = malloc(size > 0 ? size : 1);
+  size_t offset = 0;
+
+  *compressed_size = 0;
+  while (data != NULL && offset < size) {
+    ssize_t bytes_read = pread(file_fd, data + offset, size - offset, offset);
+    if (bytes_read < 0 && errno == EINTR)
+      continue;
+    if (bytes_read <= 0) {
+      free(data);
+      return NULL;
+    }
+    offset += bytes_read;
+  }
+  if (data == NULL)
+    return NULL;
+
+  char *compressed = gzip_compress(data, size, gzip_level, compressed_size);
+  free(data);
+  return compressed;
+}
+
+/* Bytes of directory listing sent per chunk */
+#define LISTING_CHUNK_SIZE 16384
+
+/*
+ * Streams the listing of directory DIR_NAME as a chunked response, one
+ * buffer of entries at a time. Unless the listing turns out too large, the
+ * rendered HTML is also kept in the cache under CACHE_KEY until the
+ * directory changes.
+ */
+void send_listing(int fd, struct http_request *request, char *dir_name,
+    struct stat *dir_stat, char *cache_key) {
+  struct http_conn *conn = http_conn_get(fd);
+  struct http_listing listing;
+  char buf[LISTING_CHUNK_SIZE];
+  size_t len;
+
+  if (http_listing_open(&listing, dir_name) == -1) {
+    send_html(fd, 403, "<center><h1>403 Forbidden</h1><hr></center>");
+    return;
+  }
+
+  /* HTTP/1.0 has no chunked encoding; closing the connection ends the body */
+  int chunked = strcmp(request->version, "HTTP/1.0") != 0;
+  if (!chunked)
+    conn->keep_alive = 0;
+
+  http_start_response(fd, 200);
+  http_send_header(fd, "Content-Type", "text/html");
+  if (chunked)
+    http_send_header(fd, "Transfer-Encoding", "chunked");
+  http_end_headers(fd);
+
+  char *html = NULL;
+  size_t html_len = 0, html_size = 0;
+  int caching = listing_cache && cache_key[0] != '\0';
+
+  while ((len = http_listing_read(&listing, buf, sizeof(buf))) > 0) {
+    if (chunked)
+      http_send_chunk(fd, buf, len);
+    else
+      http_send_data(fd, buf, len);
+
+    /* Keep a copy for the cache for as long as it could still fit there */
+    if (caching && !cache_accepts(html_len + len)) {
+      caching = 0;
+    } else if (caching) {
+      if (html_len + len > html_size) {
+        html_size = html_len + len > 2 * html_size ? html_len + len : 2 * html_size;
+        char *grown = realloc(html, html_size);
+        if (grown == NULL)
+          caching = 0;
+        else
+          html = grown;
+      }
+      if (caching) {
+        memcpy(html + html_len, buf, len);
+        html_len += len;
+      }
+    }
+  }
+  if (chunked)
+    http_send_chunk(fd, NULL, 0);
+  http_listing_close(&listing);
+
+  cache_entry_t *entry;
+  if (caching && html_len > 0 &&
+      (entry = cache_insert_listing(cache_key, dir_name, dir_stat, html, html_len)) != NULL)
+    cache_release(entry);
+  free(html);
+}
+
 /*
  * Reads an HTTP request from stream (fd), and writes an HTTP response
  * containing:
@@ -43,6 +440,8 @@ int server_proxy_port;
  *   3) If user requested a directory and index.html doesn't exist, send a list
  *      of files in the directory with links to each.
  *   4) Send a 404 Not Found response.
+ *
+ * The connection is left open; the caller decides whether to keep it alive.
  */
 void handle_files_request(int fd) {
 
@@ -52,42 +451,141 @@ void handle_files_request(int fd) {
    */
 
   struct http_request *request = http_request_parse(fd);
+  if (request == NULL) {
+    send_error(fd);
+    return;
+  }
+  metrics_mark(METRICS_PARSE);
 
-  char *str;
-  str = read_path(server_files_directory, request->path);
-  
-  if(str == NULL) {
-    http_start_response(fd, 404);
-    http_send_header(fd, "Content-Type", "text/html");
-    http_end_headers(fd); 
-    http_send_string(fd,
+  if (metrics_enabled && strcmp(request->path, metrics_path) == 0) {
+    pathcache_entry_t *path = pathcache_lookup(request->path);
+    if (path == NULL) {
+      send_metrics(fd);
+      return;
+    }
+    pathcache_release(path);
+  }
+
+  /* Hot files are answered from memory without touching the filesystem.
+   * Clients taking gzip look for a compressed copy first, under its own key. */
+  int gzip = http_accepts_encoding(request, "gzip");
+  char cache_key[PATH_MAX], gzip_key[PATH_MAX + sizeof(GZIP_KEY_SUFFIX)];
+  cache_entry_t *entry = NULL;
+  int key_len = snprintf(cache_key, sizeof(cache_key), "%s%s", server_files_directory,
+      request->path);
+  if (key_len >= 0 && (size_t) key_len < sizeof(cache_key)) {
+    snprintf(gzip_key, sizeof(gzip_key), "%s" GZIP_KEY_SUFFIX, cache_key);
+    if (gzip && (entry = cache_lookup(gzip_key)) != NULL) {
+      send_cached(fd, request, entry);
+      cache_release(entry);
+      return;
+    }
+    /* They get a plain copy that could be compressed once it has been, or
+     * once it turned out not to shrink */
+    if ((entry = cache_lookup(cache_key)) != NULL) {
+      if (gzip && !entry->listing && !__atomic_load_n(&entry->incompressible, __ATOMIC_RELAXED) &&
+          gzip_on_the_fly(entry->mime_type, entry->size))
+        entry = gzip_cached(entry, gzip_key);
+      send_cached(fd, request, entry);
+      cache_release(entry);
+      return;
+    }
+  } else {
+    cache_key[0] = gzip_key[0] = '\0';
+  }
+
+  /* Where the path leads is usually known, with the file already open */
+  pathcache_entry_t *path = pathcache_lookup(request->path);
+  struct stat file_stat;
+  struct file_body body;
+  char *file_name = NULL;
+  int file_fd = -1;
+
+  body.entry = NULL;
+  body.data = NULL;
+  body.encoding = NULL;
+
+  if (path != NULL && path->file_fd != -1) {
+    file_name = path->file_name;
+    file_fd = path->file_fd;
+    file_stat = path->file_stat;
+    body.mime_type = path->mime_type;
+
+    if (gzip && path->gz_fd != -1) {
+      file_name = path->gz_name;
+      file_fd = path->gz_fd;
+      file_stat = path->gz_stat;
+      body.encoding = "gzip";
+    }
+    if (gzip && body.encoding == NULL && gzip_on_the_fly(body.mime_type, file_stat.st_size))
+      body.encoding = "gzip";
+
+    /* Revalidation is answered from the cached stat alone */
+    http_make_validators(&body.validators, file_stat.st_ino, file_stat.st_size,
+        &file_stat.st_mtim, body.encoding);
+    if (http_not_modified(request, &body.validators)) {
+      send_not_modified(fd, &body.validators);
+      pathcache_release(path);
+      return;
+    }
+  }
+
+  if (path == NULL) {
+    send_html(fd, 404,
         "<center>"
         "<h1>Welcome to httpserver!</h1>"
         "<hr>"
         "<p>Nothing's here yet.</p>"
         "</center>");
+  } else if (file_fd == -1) {
+    /* Directory without index.html */
+    send_listing(fd, request, path->file_name, &path->file_stat, cache_key);
   } else {
-    size_t con_len;
-    
-    http_start_response(fd, 200);
-    if(full_file_name == NULL) {
-      http_send_header(fd, "Content-Type", "text/html");
-      con_len = sizeof(str);
+    char *key = body.encoding != NULL ? gzip_key : cache_key;
+    size_t compressed_size;
+    int incompressible = 0;
+
+    /* A file that has to come from disk first is sent as it is; it gets
+     * compressed and cached once it is warm */
+    body.cold = fileio_cold(file_fd, 0, file_stat.st_size);
+
+    /* Compress on the fly, unless the file was precompressed */
+    if (body.encoding != NULL && file_fd != path->gz_fd) {
+      body.data = body.cold ? NULL : gzip_file(file_fd, file_stat.st_size, &compressed_size);
+      if (body.data == NULL) {
+        /* Not worth it after all (or not yet, or no memory for it); send
+         * the file as it is */
+        incompressible = !body.cold && compressed_size > 0;
+        body.encoding = NULL;
+        key = cache_key;
+        http_make_validators(&body.validators, file_stat.st_ino, file_stat.st_size,
+            &file_stat.st_mtim, NULL);
+      }
     }
-    else {
-      http_send_header(fd, "Content-Type", http_get_mime_type(full_file_name));
-      con_len = get_content_length(full_file_name);
+
+    body.file_fd = file_fd;
+    body.size = file_stat.st_size;
+    if (body.data != NULL)
+      body.size = compressed_size;
+
+    if (key[0] != '\0' && !body.cold && cache_accepts(body.size)) {
+      if (body.data != NULL)
+        body.entry = cache_insert_data(key, file_name, &file_stat, body.mime_type,
+            body.encoding, body.data, body.size);
+      else
+        body.entry = cache_insert(key, file_name, file_fd, &file_stat, body.mime_type,
+            body.encoding, body.encoding != NULL ? path->file_name : NULL, &path->file_stat);
+      if (body.entry != NULL && incompressible)
+        __atomic_store_n(&body.entry->incompressible, 1, __ATOMIC_RELAXED);
     }
-    int l_length = snprintf( NULL, 0, "%ld", con_len);
-    char* str_len = malloc( l_length + 1 );
-    snprintf( str_len, l_length + 1, "%ld", con_len);
-    
-    http_send_header(fd, "Content-Length", str_len);
-    http_end_headers(fd);
-    http_send_string(fd, str);
+    send_file(fd, request, &body);
+    if (body.entry != NULL)
+      cache_release(body.entry);
+    free(body.data);
   }
-  free(str);
-  close(fd);
+
+  if (path != NULL)
+    pathcache_release(path);
 }
 
 /* Make socket to non blocking */
@@ -116,136 +614,77 @@ int setnonblock(int fd) {
 void handle_proxy_request(int fd) {
 
   /*
-  * The code below does a DNS lookup of server_proxy_hostname and 
-  * opens a connection to it. Please do not modify.
+  * Take a connection to server_proxy_hostname from UPSTREAM, which caches
+  * the DNS lookup and keeps connections established ahead of time.
   */
 
-  struct sockaddr_in target_address;
-  memset(&target_address, 0, sizeof(target_address));
-  target_address.sin_family = AF_INET;
-  target_address.sin_port = htons(server_proxy_port);
-
-  struct hostent *target_dns_entry = gethostbyname2(server_proxy_hostname, AF_INET);
-
-  int client_socket_fd = socket(PF_INET, SOCK_STREAM, 0);
-  if (client_socket_fd == -1) {
-    fprintf(stderr, "Failed to create a new socket: error %d: %s\n", errno, strerror(errno));
-    exit(errno);
-  }
-
-  if (target_dns_entry == NULL) {
-    fprintf(stderr, "Cannot find host: %s\n", server_proxy_hostname);
-    exit(ENXIO);
+  struct http_conn *conn = http_conn_get(fd);
+  if (conn == NULL) {
+    http_close(fd);
+    return;
   }
 
-  char *dns_address = target_dns_entry->h_addr_list[0];
+  int client_socket_fd = upstream_connect();
 
-  memcpy(&target_address.sin_addr, dns_address, sizeof(target_address.sin_addr));
-  int connection_status = connect(client_socket_fd, (struct sockaddr*) &target_address,
-      sizeof(target_address));
-
-  if (connection_status < 0) {
+  if (client_socket_fd < 0) {
     /* Dummy request parsing, just to be compliant. */
     http_request_parse(fd);
+    conn->keep_alive = 0;
 
-    http_start_response(fd, 502);
-    http_send_header(fd, "Content-Type", "text/html");
-    http_end_headers(fd);
-    http_send_string(fd, "<center><h1>502 Bad Gateway</h1><hr></center>");
+    send_html(fd, 502, "<center><h1>502 Bad Gateway</h1><hr></center>");
     return;
 
   }
 
-  /* 
-  * TODO: Your solution for task 3 belongs here! 
-  */
-
-  if(setnonblock(fd) || setnonblock(client_socket_fd)) {
-    fprintf(stderr, "Cannot set socket to non blocking\n");
-    return ;
+  /* Forward whatever the event loop already read from the client */
+  conn->keep_alive = 0;
+  if (conn->len > 0) {
+    http_send_data(client_socket_fd, conn->buf, conn->len);
+    conn->len = 0;
   }
 
-  #define MAX_EVENT 2
-  struct epoll_event ev, events[MAX_EVENT];
-  /* Create epoll event */
-  int epollfd;
-  if( (epollfd = epoll_create1(0)) == -1) {
-    perror("epoll_create1");
-    return ;
+  /*
+   * Hand both sockets to a proxy reactor, which splices between them until
+   * both sides are done. It gets its own descriptor for the client, so the
+   * caller closing FD once we return doesn't cut the connection.
+   */
+  int relay_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  if (relay_fd == -1 || setnonblock(relay_fd) || setnonblock(client_socket_fd)) {
+    fprintf(stderr, "Cannot hand connection to proxy reactor: %s\n", strerror(errno));
+  } else if (relay_submit(relay_fd, client_socket_fd) == 0) {
+    return;
   }
 
- /* Control operation */ 
- ev.events = EPOLLIN;
- ev.data.fd = fd;
- if(epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
-     fprintf(stderr, "epoll_ctl - fd: %s\n", strerror(errno));
-    return ;
- }
+  if (relay_fd != -1)
+    close(relay_fd);
+  upstream_release(client_socket_fd);
+}
 
- ev.data.fd = client_socket_fd;
- if(epoll_ctl(epollfd, EPOLL_CTL_ADD, client_socket_fd, &ev) == -1) {
-    fprintf(stderr, "epollfd_ctl - client_socket_fd: %s\n", strerror(errno));
-    return ;
- }
-
- int flag = 1;
- while(flag) {
-  /* wait for io operation */
-  int nfds, n;
-  if((nfds = epoll_wait(epollfd, events, MAX_EVENT, -1)) == -1) {
-    fprintf(stderr, "Error in epoll wait: %s\n", strerror(errno));
-    flag = 0;
-    break;
-  }
-  for(n=0; n<nfds; n++) {
-    char buf[1024];
-
-    if(events[n].data.fd == fd && (events[n].events == EPOLLIN)) {
-      /* Read */
-      size_t r = read(fd, buf, sizeof(buf));
-      if(r == -1) {
-        fprintf(stderr, "Error in read - fd: %s\n", strerror(errno));
-        flag = 0;
-        break;
-      } else if(r == 0) {
-        flag = 0;
-        break;
-      }
-      
-      r = write(client_socket_fd, buf, sizeof(buf));
-      if(r == -1) {
-        fprintf(stderr, "Error in write - client_socket_fd: %s\n", strerror(errno));
-        flag = 0;
-        break;
-      }
-    } else if(events[n].data.fd == client_socket_fd && (events[n].events == EPOLLIN)) {
-      
-      size_t r = read(client_socket_fd, buf, sizeof(buf));
-      if(r == -1) {
-        fprintf(stderr, "Error in read - client_socket_fd: %s\n", strerror(errno));
-        flag = 0;
-        break;
-      } else if(r == 0) {
-        flag = 0;
-        break;
-      }
-
-      r = write(fd, buf, sizeof(buf));
-      if(r == -1) {
-        fprintf(stderr, "Error in write - fd: %s\n", strerror(errno));
-        flag = 0;
-        break;
-      }
-    } else {
-      continue;
-    }
-  }
- }
 
- close(epollfd);
+/* Turn a connection away for REASON (see metrics.h) while overloaded: answer
+ * its request with 503 straight away, without reading or handling it */
+void reject_connection(int fd, int reason) {
+  static __thread char discard[LIBHTTP_REQUEST_MAX_SIZE];
+  struct http_conn *conn = http_conn_get(fd);
 
+  metrics_reject(reason);
+  /* A kept-alive connection with no request waiting is simply closed */
+  if (conn != NULL && (conn->requests == 0 || http_conn_ready(conn) == 1)) {
+    /* Take in what the client already sent, or closing would reset the
+     * connection before it reads the answer. Only one read: this runs on
+     * the accepting thread, which a client that keeps sending must not hold */
+    recv(fd, discard, sizeof(discard), MSG_DONTWAIT);
+    conn->error = 503;
+    http_reject(conn);
+    shutdown(fd, SHUT_WR);
+  }
+  http_close(fd);
 }
 
+/* For requests that waited in the queue past --queue-timeout */
+void reject_late_request(int fd) {
+  reject_connection(fd, METRICS_QUEUE_TIMEOUT);
+}
 
 void init_thread_pool(int num_threads, void (*request_handler)(int)) {
   /*
@@ -256,34 +695,120 @@ void init_thread_pool(int num_threads, void (*request_handler)(int)) {
   if(num_threads <= 0)
     return ;
   
-  /* Initialize thread pool */
-  if (thpool_init(num_threads, request_handler) == 0) {
+  /* Initialize thread pool; it grows from min_threads up to num_threads */
+  if (thpool_init(min_threads, num_threads, request_handler, reject_late_request) == 0) {
     fprintf(stderr, "Error in creaating thread pool\n");
     exit(1);
   }
   
 }
 
+void (*server_request_handler)(int);
+
+/* Handle one request on CONN, recording how long it took and what was sent,
+ * then release its scratch memory. Returns 0 if the rest of the response was
+ * left to FILEIO, which gives the connection back through resume_connection. */
+int serve_request(struct http_conn *conn) {
+  uint64_t start = accesslog_enabled ? wq_clock() : 0;
+
+  conn->status = 0;
+  metrics_request_begin();
+  server_request_handler(conn->fd);
+  metrics_request_end(conn->status, conn->bytes_sent);
+  if (accesslog_enabled && conn->status != 0)
+    accesslog_record(conn, wq_clock() - start);
+  http_scratch_reset();
+  return !fileio_flush();
+}
+
+/* Serve requests on FD until the client or the keep-alive policy ends it */
+void serve_connection(int fd) {
+  struct http_conn *conn = http_conn_get(fd);
+  if (conn == NULL) {
+    http_close(fd);
+    return;
+  }
+  /* One back from FILEIO waits for its next request like any kept-alive one */
+  if (conn->requests > 0 && !http_conn_wait(conn)) {
+    http_close(fd);
+    return;
+  }
+  do {
+    if (!serve_request(conn))
+      return;
+    /* A pipelined request goes on this worker's deque, where it stays
+     * warm unless an idle worker steals it */
+    if (conn->keep_alive && http_conn_ready(conn) == 1) {
+      thpool_submit(serve_connection, fd);
+      return;
+    }
+  } while (conn->keep_alive && http_conn_wait(conn));
+  http_close(fd);
+}
+
+/* Serve the request the event loop read, queue any pipelined after it on
+ * this worker's deque, or give the connection back to the event loop while
+ * it sits idle */
+void serve_event_request(int fd) {
+  struct http_conn *conn = http_conn_get(fd);
+  if (conn == NULL) {
+    http_close(fd);
+    return;
+  }
+  if (!serve_request(conn))
+    return;
+
+  if (conn->keep_alive && http_conn_ready(conn) == 1)
+    thpool_submit(serve_event_request, fd);
+  else if (conn->keep_alive)
+    evloop_resume(fd);
+  else
+    http_close(fd);
+}
+
+/* Hand a client connection to the thread pool, or serve it inline without one */
+void dispatch_request(int fd) {
+  if (num_threads > 0) {
+    if (add_to_work_queue(fd) == -1)
+      reject_connection(fd, METRICS_QUEUE_FULL);
+  } else if (server_event_loop)
+    serve_event_request(fd);
+  else
+    serve_connection(fd);
+}
+
+/* Take a connection back from FILEIO once its response is out, and wait for
+ * its next request the way any kept-alive connection does */
+void resume_connection(int fd, int ok) {
+  struct http_conn *conn = http_conn_get(fd);
+  if (conn == NULL || !ok || !conn->keep_alive)
+    http_close(fd);
+  else if (server_event_loop && http_conn_ready(conn) == 0)
+    evloop_resume(fd);
+  else
+    dispatch_request(fd);
+}
+
 /*
- * Opens a TCP stream socket on all interfaces with port number PORTNO. Saves
- * the fd number of the server socket in *socket_number. For each accepted
- * connection, calls request_handler with the accepted fd number.
+ * Opens a TCP stream socket on all interfaces with port number server_port
+ * and returns it. With REUSE_PORT set, several such sockets can listen on the
+ * port at once and the kernel spreads incoming connections across them.
  */
-void serve_forever(int *socket_number, void (*request_handler)(int)) {
+int open_listener(int reuse_port) {
 
-  struct sockaddr_in server_address, client_address;
-  size_t client_address_length = sizeof(client_address);
-  int client_socket_number;
+  struct sockaddr_in server_address;
 
-  *socket_number = socket(PF_INET, SOCK_STREAM, 0);
-  if (*socket_number == -1) {
+  int socket_number = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (socket_number == -1) {
     perror("Failed to create a new socket");
     exit(errno);
   }
 
   int socket_option = 1;
-  if (setsockopt(*socket_number, SOL_SOCKET, SO_REUSEADDR, &socket_option,
-        sizeof(socket_option)) == -1) {
+  if (setsockopt(socket_number, SOL_SOCKET, SO_REUSEADDR, &socket_option,
+        sizeof(socket_option)) == -1 || (reuse_port &&
+      setsockopt(socket_number, SOL_SOCKET, SO_REUSEPORT, &socket_option,
+        sizeof(socket_option)) == -1)) {
     perror("Failed to set socket options");
     exit(errno);
   }
@@ -293,23 +818,37 @@ void serve_forever(int *socket_number, void (*request_handler)(int)) {
   server_address.sin_addr.s_addr = INADDR_ANY;
   server_address.sin_port = htons(server_port);
 
-  if (bind(*socket_number, (struct sockaddr *) &server_address,
+  if (bind(socket_number, (struct sockaddr *) &server_address,
         sizeof(server_address)) == -1) {
     perror("Failed to bind on socket");
     exit(errno);
   }
 
-  if (listen(*socket_number, 1024) == -1) {
+  if (listen(socket_number, 1024) == -1) {
     perror("Failed to listen on socket");
     exit(errno);
   }
 
-  printf("Listening on port %d...\n", server_port);
+  return socket_number;
+}
+
+struct acceptor {
+  int socket_number;
+  int cpu;              // CPU to run on, or -1 to float
+};
 
-  init_thread_pool(num_threads, request_handler);
+/* Accept connections on one listener forever, dispatching each of them */
+void *accept_loop(void *arg) {
+  struct acceptor *acceptor = arg;
+  struct sockaddr_in client_address;
+  size_t client_address_length = sizeof(client_address);
+  int client_socket_number;
+
+  if (acceptor->cpu >= 0)
+    affinity_pin(acceptor->cpu);
 
   while (1) {
-    client_socket_number = accept(*socket_number,
+    client_socket_number = accept(acceptor->socket_number,
         (struct sockaddr *) &client_address,
         (socklen_t *) &client_address_length);
     if (client_socket_number < 0) {
@@ -317,21 +856,77 @@ void serve_forever(int *socket_number, void (*request_handler)(int)) {
       continue;
     }
 
-    printf("Accepted connection from %s on port %d\n",
-        inet_ntoa(client_address.sin_addr),
-        client_address.sin_port);
+    /* Sends on this blocking socket give up on a client that stops reading */
+    struct timeval send_timeout = { .tv_sec = http_send_timeout };
+    setsockopt(client_socket_number, SOL_SOCKET, SO_SNDTIMEO, &send_timeout,
+        sizeof(send_timeout));
 
-    // TODO: Change me?
-    //request_handler(client_socket_number);
-    add_to_work_queue(client_socket_number);
+    /* Nothing is printed here; the access log has the address if enabled */
+    struct http_conn *conn = http_conn_get(client_socket_number);
+    if (conn != NULL)
+      conn->peer = client_address;
 
-    printf("Accepted connection from %s on port %d\n",
-        inet_ntoa(client_address.sin_addr),
-        client_address.sin_port);
+    dispatch_request(client_socket_number);
   }
 
-  shutdown(*socket_number, SHUT_RDWR);
-  close(*socket_number);
+  return NULL;
+}
+
+/*
+ * Opens num_listeners listening sockets on server_port and saves the fd
+ * number of the first in *socket_number. For each accepted connection, calls
+ * request_handler with the accepted fd number. Several listeners share the
+ * port through SO_REUSEPORT, each with its own accept loop (or reactor)
+ * pinned to a CPU. With NUMA grouping every node gets the same number of
+ * listeners, feeding its own pool.
+ */
+void serve_forever(int *socket_number, void (*request_handler)(int)) {
+
+  int nodes = affinity_num_nodes();
+  num_listeners = (num_listeners + nodes - 1) / nodes * nodes;
+
+  int *listeners = calloc(num_listeners, sizeof(int));
+  struct acceptor *acceptors = calloc(num_listeners, sizeof(struct acceptor));
+  if (listeners == NULL || acceptors == NULL) {
+    fprintf(stderr, "%s\n", strerror(errno));
+    exit(ENOMEM);
+  }
+
+  int i;
+  for (i = 0; i < num_listeners; i++)
+    listeners[i] = open_listener(num_listeners > 1);
+  *socket_number = listeners[0];
+
+  printf("Listening on port %d...\n", server_port);
+  fflush(stdout);   // The access log writes to the descriptor directly
+
+  server_request_handler = request_handler;
+  init_thread_pool(num_threads, server_event_loop ? serve_event_request : serve_connection);
+
+  if (server_event_loop) {
+    evloop_run(listeners, num_listeners, num_reactors, dispatch_request);
+  }
+
+  for (i = 0; i < num_listeners; i++) {
+    acceptors[i].socket_number = listeners[i];
+    acceptors[i].cpu = num_listeners > 1 || affinity_has_cpus(AFFINITY_ACCEPTORS) ? i : -1;
+  }
+
+  for (i = 1; i < num_listeners; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, accept_loop, &acceptors[i]) != 0) {
+      fprintf(stderr, "Error in creating accept thread: %s\n", strerror(errno));
+      exit(1);
+    }
+    pthread_detach(thread);
+  }
+
+  accept_loop(&acceptors[0]);
+
+  for (i = 0; i < num_listeners; i++) {
+    shutdown(listeners[i], SHUT_RDWR);
+    close(listeners[i]);
+  }
 }
 
 int server_fd;
@@ -342,9 +937,61 @@ void signal_callback_handler(int signum) {
   exit(0);
 }
 
+/* SIGHUP: let a tool like logrotate move the access log away */
+void reopen_access_log(int signum) {
+  (void) signum;
+  accesslog_reopen();
+}
+
 char *USAGE =
   "Usage: ./httpserver --files www_directory/ --port 8000 [--num-threads 5]\n"
-  "       ./httpserver --proxy inst.eecs.berkeley.edu:80 --port 8000 [--num-threads 5]\n";
+  "       ./httpserver --proxy inst.eecs.berkeley.edu:80 --port 8000 [--num-threads 5]\n"
+  "\n"
+  "Options:\n"
+  "  --event-loop          accept and read requests in epoll reactors\n"
+  "  --num-reactors N      number of reactor threads for --event-loop (default 1)\n"
+  "  --listeners N         SO_REUSEPORT listening sockets, each accepting on its own\n"
+  "                        CPU (default 1)\n"
+  "  --worker-cpus LIST    CPUs worker threads may run on, as for taskset -c, e.g.\n"
+  "                        0-3,8 (default all)\n"
+  "  --accept-cpus LIST    CPUs to pin accept threads and reactors to, one each\n"
+  "                        (default all)\n"
+  "  --numa                run a thread pool on each NUMA node, fed by listeners\n"
+  "                        pinned to that node and using its memory\n"
+  "  --keep-alive-timeout S   seconds to keep idle connections open, 0 disables (default 5)\n"
+  "  --max-keep-alive-requests N   requests served per connection (default 100)\n"
+  "  --send-timeout S      seconds to wait on a client that stops reading a\n"
+  "                        response before closing it (default 60)\n"
+  "  --cache-size MB       memory for caching small files, 0 disables (default 64)\n"
+  "  --no-listing-cache    don't cache rendered directory listings\n"
+  "  --path-cache-size N   request paths to keep resolved, with their files open,\n"
+  "                        0 disables (default 1024)\n"
+  "  --access-log PATH     log responses to this file as JSON lines, - for standard\n"
+  "                        output (default off); reopened on SIGHUP\n"
+  "  --access-log-max-size MB   rotate the access log at this size, 0 never (default 0)\n"
+  "  --metrics-path PATH   where to serve metrics when no file is there\n"
+  "                        (default /metrics)\n"
+  "  --no-metrics          don't record request metrics or serve them\n"
+  "  --disk-io MODE        how files not in the page cache are sent, without holding\n"
+  "                        a worker: uring, threads or off (default uring, falling\n"
+  "                        back to threads)\n"
+  "  --disk-threads N      threads sending cold files without io_uring (default 4)\n"
+  "  --gzip-level N        compression level for text files, 0 only serves\n"
+  "                        precompressed .gz files (default 6)\n"
+  "  --min-threads N       start with N threads and grow on demand\n"
+  "  --max-threads N       never run more than N threads\n"
+  "  --max-queue N         connections waiting for a thread before new ones are\n"
+  "                        answered 503 right away (default 65536)\n"
+  "  --queue-timeout MS    answer 503 instead of serving a connection that waited\n"
+  "                        longer for a thread, 0 never (default 0)\n"
+  "  --thread-idle-timeout S   seconds before an idle extra thread exits (default 30)\n"
+  "  --queue-wait-target MS    add threads when requests wait longer (default 50)\n"
+  "  --proxy-preconnect N  connections to the proxy target opened ahead of use,\n"
+  "                        each used for one client connection (default 8)\n"
+  "  --proxy-max-conns N   most connections open to the proxy target (default 1024)\n"
+  "  --proxy-dns-ttl S     seconds to cache the proxy target's address (default 60)\n"
+  "  --proxy-chunk-size KB   bytes in flight per direction of a proxied connection (default 256)\n"
+  "  --proxy-reactors N    threads relaying proxied connections (default 1)\n";
 
 void exit_with_usage() {
   fprintf(stderr, "%s", USAGE);
@@ -353,10 +1000,12 @@ void exit_with_usage() {
 
 int main(int argc, char **argv) {
   signal(SIGINT, signal_callback_handler);
+  signal(SIGPIPE, SIG_IGN);
 
   /* Default settings */
   server_port = 8000;
   void (*request_handler)(int) = NULL;
+  int max_threads = 0;
 
   int i;
   for (i = 1; i < argc; i++) {
@@ -399,6 +1048,178 @@ int main(int argc, char **argv) {
         fprintf(stderr, "Expected positive integer after --num-threads\n");
         exit_with_usage();
       }
+    } else if (strcmp("--min-threads", argv[i]) == 0) {
+      char *min_threads_str = argv[++i];
+      if (!min_threads_str || (min_threads = atoi(min_threads_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --min-threads\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--max-threads", argv[i]) == 0) {
+      char *max_threads_str = argv[++i];
+      if (!max_threads_str || (max_threads = atoi(max_threads_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --max-threads\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--max-queue", argv[i]) == 0) {
+      char *max_queue_str = argv[++i];
+      if (!max_queue_str || atoi(max_queue_str) < 1) {
+        fprintf(stderr, "Expected positive integer after --max-queue\n");
+        exit_with_usage();
+      }
+      thpool_max_queue = atoi(max_queue_str);
+    } else if (strcmp("--queue-timeout", argv[i]) == 0) {
+      char *queue_timeout_str = argv[++i];
+      if (!queue_timeout_str || (thpool_queue_timeout = atoi(queue_timeout_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --queue-timeout\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--thread-idle-timeout", argv[i]) == 0) {
+      char *idle_timeout_str = argv[++i];
+      if (!idle_timeout_str || (thpool_idle_timeout = atoi(idle_timeout_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --thread-idle-timeout\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--queue-wait-target", argv[i]) == 0) {
+      char *wait_target_str = argv[++i];
+      if (!wait_target_str || (thpool_wait_target = atoi(wait_target_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --queue-wait-target\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--proxy-preconnect", argv[i]) == 0) {
+      char *preconnect_str = argv[++i];
+      if (!preconnect_str || (proxy_preconnect = atoi(preconnect_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --proxy-preconnect\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--proxy-max-conns", argv[i]) == 0) {
+      char *max_conns_str = argv[++i];
+      if (!max_conns_str || (proxy_max_conns = atoi(max_conns_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --proxy-max-conns\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--proxy-dns-ttl", argv[i]) == 0) {
+      char *dns_ttl_str = argv[++i];
+      if (!dns_ttl_str || (proxy_dns_ttl = atoi(dns_ttl_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --proxy-dns-ttl\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--proxy-reactors", argv[i]) == 0) {
+      char *proxy_reactors_str = argv[++i];
+      if (!proxy_reactors_str || (proxy_reactors = atoi(proxy_reactors_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --proxy-reactors\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--proxy-chunk-size", argv[i]) == 0) {
+      char *chunk_size_str = argv[++i];
+      int chunk_kb;
+      if (!chunk_size_str || (chunk_kb = atoi(chunk_size_str)) < 4) {
+        fprintf(stderr, "Expected integer of at least 4 after --proxy-chunk-size\n");
+        exit_with_usage();
+      }
+      proxy_chunk_kb = chunk_kb;
+    } else if (strcmp("--gzip-level", argv[i]) == 0) {
+      char *gzip_level_str = argv[++i];
+      if (!gzip_level_str || (gzip_level = atoi(gzip_level_str)) < 0 || gzip_level > 9) {
+        fprintf(stderr, "Expected integer from 0 to 9 after --gzip-level\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--access-log", argv[i]) == 0) {
+      access_log_path = argv[++i];
+      if (!access_log_path) {
+        fprintf(stderr, "Expected a file name after --access-log\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--access-log-max-size", argv[i]) == 0) {
+      char *access_log_max_str = argv[++i];
+      if (!access_log_max_str || atoi(access_log_max_str) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --access-log-max-size\n");
+        exit_with_usage();
+      }
+      access_log_max_mb = atoi(access_log_max_str);
+    } else if (strcmp("--metrics-path", argv[i]) == 0) {
+      metrics_path = argv[++i];
+      if (!metrics_path || metrics_path[0] != '/') {
+        fprintf(stderr, "Expected a path starting with / after --metrics-path\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--no-metrics", argv[i]) == 0) {
+      metrics_enabled = 0;
+    } else if (strcmp("--no-listing-cache", argv[i]) == 0) {
+      listing_cache = 0;
+    } else if (strcmp("--event-loop", argv[i]) == 0) {
+      server_event_loop = 1;
+    } else if (strcmp("--listeners", argv[i]) == 0) {
+      char *num_listeners_str = argv[++i];
+      if (!num_listeners_str || (num_listeners = atoi(num_listeners_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --listeners\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--worker-cpus", argv[i]) == 0 ||
+        strcmp("--accept-cpus", argv[i]) == 0) {
+      int role = strcmp("--worker-cpus", argv[i]) == 0 ? AFFINITY_WORKERS : AFFINITY_ACCEPTORS;
+      char *cpus_str = argv[++i];
+      if (!cpus_str || affinity_set_cpus(role, cpus_str) == -1) {
+        fprintf(stderr, "Expected a list of usable CPUs after %s\n", argv[i - 1]);
+        exit_with_usage();
+      }
+    } else if (strcmp("--numa", argv[i]) == 0) {
+      affinity_numa = 1;
+    } else if (strcmp("--num-reactors", argv[i]) == 0) {
+      char *num_reactors_str = argv[++i];
+      if (!num_reactors_str || (num_reactors = atoi(num_reactors_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --num-reactors\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--keep-alive-timeout", argv[i]) == 0) {
+      char *timeout_str = argv[++i];
+      if (!timeout_str || (http_keep_alive_timeout = atoi(timeout_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --keep-alive-timeout\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--send-timeout", argv[i]) == 0) {
+      char *send_timeout_str = argv[++i];
+      if (!send_timeout_str || (http_send_timeout = atoi(send_timeout_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --send-timeout\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--max-keep-alive-requests", argv[i]) == 0) {
+      char *max_requests_str = argv[++i];
+      if (!max_requests_str || (http_keep_alive_max_requests = atoi(max_requests_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --max-keep-alive-requests\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--cache-size", argv[i]) == 0) {
+      char *cache_size_str = argv[++i];
+      if (!cache_size_str || atoi(cache_size_str) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --cache-size\n");
+        exit_with_usage();
+      }
+      cache_size_mb = atoi(cache_size_str);
+    } else if (strcmp("--disk-io", argv[i]) == 0) {
+      char *disk_io_str = argv[++i];
+      if (disk_io_str && strcmp(disk_io_str, "uring") == 0) {
+        disk_io_mode = FILEIO_URING;
+      } else if (disk_io_str && strcmp(disk_io_str, "threads") == 0) {
+        disk_io_mode = FILEIO_THREADS;
+      } else if (disk_io_str && strcmp(disk_io_str, "off") == 0) {
+        disk_io_mode = FILEIO_OFF;
+      } else {
+        fprintf(stderr, "Expected uring, threads or off after --disk-io\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--disk-threads", argv[i]) == 0) {
+      char *disk_threads_str = argv[++i];
+      if (!disk_threads_str || (disk_threads = atoi(disk_threads_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --disk-threads\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--path-cache-size", argv[i]) == 0) {
+      char *path_cache_str = argv[++i];
+      if (!path_cache_str || atoi(path_cache_str) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --path-cache-size\n");
+        exit_with_usage();
+      }
+      path_cache_size = atoi(path_cache_str);
     } else if (strcmp("--help", argv[i]) == 0) {
       exit_with_usage();
     } else {
@@ -413,6 +1234,35 @@ int main(int argc, char **argv) {
     exit_with_usage();
   }
 
+  /* --num-threads alone means a fixed pool; the bounds make it elastic */
+  if (max_threads == 0)
+    max_threads = num_threads > min_threads ? num_threads : min_threads;
+  if (min_threads == 0 && max_threads > 0)
+    min_threads = num_threads > 0 && num_threads < max_threads ? num_threads :
+      (num_threads > 0 ? max_threads : 1);
+  if (min_threads > max_threads) {
+    fprintf(stderr, "--min-threads can't be larger than --max-threads\n");
+    exit_with_usage();
+  }
+  num_threads = max_threads;
+
+  if (access_log_path != NULL) {
+    accesslog_init(access_log_path, access_log_max_mb << 20);
+    signal(SIGHUP, reopen_access_log);
+  }
+
+  if (request_handler == handle_files_request) {
+    cache_init(cache_size_mb << 20);
+    pathcache_init(server_files_directory, path_cache_size);
+    /* Connections come back to workers; without any, the accept loop waits */
+    fileio_init(num_threads > 0 ? disk_io_mode : FILEIO_OFF, disk_threads,
+        resume_connection);
+  } else {
+    upstream_init(server_proxy_hostname, server_proxy_port, proxy_preconnect,
+        proxy_max_conns, proxy_dns_ttl);
+    relay_init(proxy_reactors, proxy_chunk_kb * 1024, upstream_release);
+  }
+
   serve_forever(&server_fd, request_handler);
 
   return EXIT_SUCCESS;
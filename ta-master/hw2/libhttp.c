@@ -1,15 +1,32 @@
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 
 #include "libhttp.h"
 
-#define LIBHTTP_REQUEST_MAX_SIZE 8192
+/* Largest single sendfile() call; keeps one huge file from starving the
+ * socket of other work and stays well below the kernel's 2 GB limit. */
+#define LIBHTTP_SENDFILE_CHUNK (1 << 20)
+#define LIBHTTP_COPY_BUFFER_SIZE 16384
+
+/* Largest value of the signed off_t */
+#define LIBHTTP_OFF_MAX ((off_t) ((1ULL << (sizeof(off_t) * 8 - 1)) - 1))
 
 
 void http_fatal_error(char *message) {
@@ -17,66 +34,665 @@ void http_fatal_error(char *message) {
   exit(ENOBUFS);
 }
 
-struct http_request *http_request_parse(int fd) {
-  struct http_request *request = malloc(sizeof(struct http_request));
-  if (!request) http_fatal_error("Malloc failed");
+int http_keep_alive_timeout = 5;
+int http_keep_alive_max_requests = 100;
+int http_send_timeout = 60;
+
+/* Parser states, one per part of the request head */
+enum {
+  PARSE_START,          // Skipping blank lines before the request line
+  PARSE_METHOD,
+  PARSE_PATH,
+  PARSE_VERSION,
+  PARSE_HEADER_START,   // Start of a header line, or the blank line
+  PARSE_HEADER_NAME,
+  PARSE_HEADER_SPACE,   // Whitespace between ':' and the value
+  PARSE_HEADER_VALUE,
+  PARSE_DONE
+};
+
+/* Connection state, indexed by socket fd */
+static struct http_conn **http_conns;
+static size_t http_conns_size;
+static pthread_once_t http_conns_once = PTHREAD_ONCE_INIT;
+
+/* Closed connections' state, kept for reuse instead of going back to malloc */
+static struct http_conn *http_conn_pool[LIBHTTP_CONN_POOL_SIZE];
+static int http_conn_pool_len;
+static pthread_mutex_t http_conn_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void http_conns_init(void) {
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == -1 || limit.rlim_cur == RLIM_INFINITY)
+    limit.rlim_cur = 65536;
+  http_conns_size = limit.rlim_cur;
+  http_conns = calloc(http_conns_size, sizeof(struct http_conn *));
+  if (!http_conns) http_fatal_error("Malloc failed");
+}
 
-  char *read_buffer = malloc(LIBHTTP_REQUEST_MAX_SIZE + 1);
-  if (!read_buffer) http_fatal_error("Malloc failed");
+/* Get ready to parse the next request on the connection */
+static void http_parser_reset(struct http_conn *conn) {
+  conn->state = PARSE_START;
+  conn->scanned = 0;
+  conn->arena_used = 0;
+  conn->content_length = 0;
+  conn->claimed = 0;
+  conn->error = 0;
+  memset(&conn->request, 0, sizeof(conn->request));
+}
+
+struct http_conn *http_conn_get(int fd) {
+  pthread_once(&http_conns_once, http_conns_init);
+  if (fd < 0 || (size_t) fd >= http_conns_size)
+    return NULL;
 
-  int bytes_read = read(fd, read_buffer, LIBHTTP_REQUEST_MAX_SIZE);
-  read_buffer[bytes_read] = '\0'; /* Always null-terminate. */
+  struct http_conn *conn = http_conns[fd];
+  if (conn == NULL) {
+    pthread_mutex_lock(&http_conn_pool_lock);
+    if (http_conn_pool_len > 0)
+      conn = http_conn_pool[--http_conn_pool_len];
+    pthread_mutex_unlock(&http_conn_pool_lock);
+    if (conn == NULL && (conn = malloc(sizeof(struct http_conn))) == NULL)
+      http_fatal_error("Malloc failed");
+    conn->fd = fd;
+    memset(&conn->peer, 0, sizeof(conn->peer));
+    conn->len = 0;
+    conn->discard = 0;
+    conn->keep_alive = 0;
+    conn->requests = 0;
+    conn->head_len = 0;
+    conn->status = 0;
+    conn->bytes_sent = 0;
+    http_parser_reset(conn);
+    http_conns[fd] = conn;
+  }
+  return conn;
+}
 
-  char *read_start, *read_end;
-  size_t read_size;
+/* Returns FD's connection state if it has any; unlike http_conn_get this
+ * never creates it, so sockets that aren't clients (like the proxy's
+ * upstream) can be written to without leaving state behind */
+static struct http_conn *http_conn_find(int fd) {
+  pthread_once(&http_conns_once, http_conns_init);
+  if (fd < 0 || (size_t) fd >= http_conns_size)
+    return NULL;
+  return http_conns[fd];
+}
 
+/* Drop up to SIZE bytes from the front of the buffer */
+static void http_conn_consume(struct http_conn *conn, size_t size) {
+  if (size > conn->len)
+    size = conn->len;
+  memmove(conn->buf, conn->buf + size, conn->len - size);
+  conn->len -= size;
+  conn->buf[conn->len] = '\0';
+}
+
+ssize_t http_conn_fill(struct http_conn *conn) {
+  ssize_t bytes_read;
   do {
-    /* Read in the HTTP method: "[A-Z]*" */
-    read_start = read_end = read_buffer;
-    while (*read_end >= 'A' && *read_end <= 'Z') read_end++;
-    read_size = read_end - read_start;
-    if (read_size == 0) break;
-    request->method = malloc(read_size + 1);
-    memcpy(request->method, read_start, read_size);
-    request->method[read_size] = '\0';
-
-    /* Read in a space character. */
-    read_start = read_end;
-    if (*read_end != ' ') break;
-    read_end++;
-
-    /* Read in the path: "[^ \n]*" */
-    read_start = read_end;
-    while (*read_end != '\0' && *read_end != ' ' && *read_end != '\n') read_end++;
-    read_size = read_end - read_start;
-    if (read_size == 0) break;
-    request->path = malloc(read_size + 1);
-    memcpy(request->path, read_start, read_size);
-    request->path[read_size] = '\0';
-
-    /* Read in HTTP version and rest of request line: ".*" */
-    read_start = read_end;
-    while (*read_end != '\0' && *read_end != '\n') read_end++;
-    if (*read_end != '\n') break;
-    read_end++;
-
-    free(read_buffer);
-    return request;
-  } while (0);
-
-  /* An error occurred. */
-  free(request);
-  free(read_buffer);
+    bytes_read = read(conn->fd, conn->buf + conn->len,
+        LIBHTTP_REQUEST_MAX_SIZE - conn->len);
+  } while (bytes_read < 0 && errno == EINTR);
+  if (bytes_read > 0) {
+    conn->len += bytes_read;
+    conn->buf[conn->len] = '\0';
+
+    /* Skip the rest of a request body we are not interested in */
+    if (conn->discard > 0) {
+      size_t skipped = conn->discard < conn->len ? conn->discard : conn->len;
+      http_conn_consume(conn, skipped);
+      conn->discard -= skipped;
+    }
+  }
+  return bytes_read;
+}
+
+char *http_get_header(struct http_request *request, char *name) {
+  int i;
+  for (i = 0; i < request->num_headers; i++) {
+    if (strcasecmp(request->headers[i].name, name) == 0)
+      return request->headers[i].value;
+  }
   return NULL;
+}
+
+/* Parse a non-negative decimal number; NULL if there is none or it's huge */
+static char *http_parse_offset(char *p, off_t *value) {
+  if (*p < '0' || *p > '9')
+    return NULL;
+  *value = 0;
+  while (*p >= '0' && *p <= '9') {
+    if (*value > (LIBHTTP_OFF_MAX - 9) / 10)
+      return NULL;
+    *value = *value * 10 + (*p++ - '0');
+  }
+  return p;
+}
+
+int http_parse_ranges(char *header, off_t size, struct http_range *ranges, int max_ranges) {
+  int count = 0, specs = 0;
+  char *p = header;
+
+  while (*p == ' ' || *p == '\t')
+    p++;
+  if (strncasecmp(p, "bytes=", 6) != 0)
+    return -1;
+  p += 6;
 
+  while (1) {
+    off_t first = -1, last = -1;
+
+    while (*p == ' ' || *p == '\t')
+      p++;
+    if (*p == '-') {
+      /* Suffix: the last N bytes */
+      off_t suffix;
+      if ((p = http_parse_offset(p + 1, &suffix)) == NULL)
+        return -1;
+      if (suffix > 0 && size > 0) {
+        first = suffix < size ? size - suffix : 0;
+        last = size - 1;
+      }
+    } else {
+      if ((p = http_parse_offset(p, &first)) == NULL || *p++ != '-')
+        return -1;
+      if (*p >= '0' && *p <= '9') {
+        if ((p = http_parse_offset(p, &last)) == NULL || last < first)
+          return -1;
+      } else {
+        last = LIBHTTP_OFF_MAX;
+      }
+      if (first >= size)
+        first = -1;       // Starts past the end: unsatisfiable
+      else if (last >= size)
+        last = size - 1;
+    }
+
+    /* Too many parts costs more than sending the whole file; ignore them */
+    if (++specs > max_ranges)
+      return -1;
+    if (first >= 0) {
+      ranges[count].first = first;
+      ranges[count].last = last;
+      count++;
+    }
+
+    while (*p == ' ' || *p == '\t')
+      p++;
+    if (*p == '\0')
+      return count;
+    if (*p++ != ',')
+      return -1;
+  }
+}
+
+void http_make_validators(struct http_validators *validators, ino_t ino, off_t size,
+    struct timespec *mtime, char *encoding) {
+  struct tm tm;
+
+  /* Any change to the file changes at least one of these; each encoding of
+   * it is a different representation with its own tag */
+  snprintf(validators->etag, sizeof(validators->etag), "\"%llx-%llx-%llx%s%s\"",
+      (unsigned long long) ino, (unsigned long long) size,
+      (unsigned long long) mtime->tv_sec * 1000000000ULL + mtime->tv_nsec,
+      encoding ? "-" : "", encoding ? encoding : "");
+  gmtime_r(&mtime->tv_sec, &tm);
+  strftime(validators->last_modified, sizeof(validators->last_modified),
+      "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  validators->mtime = mtime->tv_sec;
 }
 
-char* http_get_response_message(int status_code) {
+/* Whether the comma separated entity tags in LIST include ETAG. Weak tags
+ * match too: a GET only needs the weak comparison. */
+static int http_etag_listed(char *list, char *etag) {
+  size_t etag_len = strlen(etag);
+  char *p = list;
+
+  while (*p != '\0') {
+    while (*p == ' ' || *p == '\t' || *p == ',')
+      p++;
+    if (*p == '*')
+      return 1;
+    if (strncmp(p, "W/", 2) == 0)
+      p += 2;
+    if (strncmp(p, etag, etag_len) == 0 &&
+        (p[etag_len] == '\0' || p[etag_len] == ',' || p[etag_len] == ' '))
+      return 1;
+    while (*p != '\0' && *p != ',')
+      p++;
+  }
+  return 0;
+}
+
+/* Parse an HTTP date; -1 if it isn't one */
+static time_t http_parse_date(char *date) {
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  char *end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  return end == NULL ? -1 : timegm(&tm);
+}
+
+int http_accepts_encoding(struct http_request *request, char *encoding) {
+  char *value = http_get_header(request, "Accept-Encoding");
+  size_t encoding_len = strlen(encoding);
+  int wildcard = 0;
+
+  if (value == NULL)
+    return 0;
+
+  /* "gzip, deflate;q=0.5, *;q=0": a coding is refused only with q=0 */
+  char *p = value;
+  while (*p != '\0') {
+    while (*p == ' ' || *p == '\t' || *p == ',')
+      p++;
+    char *name = p;
+    while (*p != '\0' && *p != ',' && *p != ';' && *p != ' ' && *p != '\t')
+      p++;
+    size_t name_len = p - name;
+
+    double quality = 1;
+    while (*p == ' ' || *p == '\t')
+      p++;
+    if (*p == ';') {
+      char *q = strstr(p, "q=");
+      char *next = strchr(p, ',');
+      if (q != NULL && (next == NULL || q < next))
+        quality = strtod(q + 2, NULL);
+    }
+    while (*p != '\0' && *p != ',')
+      p++;
+
+    if (name_len == encoding_len && strncasecmp(name, encoding, name_len) == 0)
+      return quality > 0;
+    if (name_len == 1 && name[0] == '*')
+      wildcard = quality > 0;
+  }
+  return wildcard;
+}
+
+int http_not_modified(struct http_request *request, struct http_validators *validators) {
+  char *value;
+
+  if ((value = http_get_header(request, "If-None-Match")) != NULL)
+    return http_etag_listed(value, validators->etag);
+  if ((value = http_get_header(request, "If-Modified-Since")) != NULL) {
+    time_t since = http_parse_date(value);
+    return since != -1 && validators->mtime <= since;
+  }
+  return 0;
+}
+
+int http_if_range(struct http_request *request, struct http_validators *validators) {
+  char *value = http_get_header(request, "If-Range");
+
+  if (value == NULL)
+    return 1;
+  /* Ranges need the strong comparison: a weak tag never matches */
+  if (value[0] == '"')
+    return strcmp(value, validators->etag) == 0;
+  return http_parse_date(value) == validators->mtime;
+}
+
+/* Move past a request that has been handled: drop its head and body */
+static void http_conn_advance(struct http_conn *conn) {
+  size_t head_length = conn->scanned;
+  size_t content_length = conn->content_length;
+
+  http_conn_consume(conn, head_length);
+  size_t skipped = content_length < conn->len ? content_length : conn->len;
+  http_conn_consume(conn, skipped);
+  conn->discard = content_length - skipped;
+  http_parser_reset(conn);
+}
+
+/* Parse a Content-Length value: digits only, no sign, and in range.
+ * Returns -1 if it is anything else. */
+static int http_parse_content_length(char *value, size_t *length) {
+  char *end;
+
+  if (*value < '0' || *value > '9')
+    return -1;
+  errno = 0;
+  unsigned long parsed = strtoul(value, &end, 10);
+  while (*end == ' ' || *end == '\t')
+    end++;
+  if (*end != '\0' || errno == ERANGE)
+    return -1;
+  *length = parsed;
+  return 0;
+}
+
+/* Connection handling implied by the parsed head. Returns -1, with the
+ * status code left in error, if the head can't be acted on. */
+static int http_conn_finish_head(struct http_conn *conn) {
+  struct http_request *request = &conn->request;
+  char *value;
+
+  /* HTTP/1.1 connections are persistent unless the client says otherwise */
+  conn->keep_alive = strcmp(request->version, "HTTP/1.1") == 0;
+  if ((value = http_get_header(request, "Connection")) != NULL) {
+    if (strcasestr(value, "close"))
+      conn->keep_alive = 0;
+    else if (strcasestr(value, "keep-alive"))
+      conn->keep_alive = 1;
+  }
+
+  /* A length we misread would have us skip into the next request */
+  if ((value = http_get_header(request, "Content-Length")) != NULL &&
+      http_parse_content_length(value, &conn->content_length) == -1) {
+    conn->error = 400;
+    conn->keep_alive = 0;
+    return -1;
+  }
+
+  /* We can't find the end of a chunked body we don't read */
+  if (http_get_header(request, "Transfer-Encoding") != NULL)
+    conn->keep_alive = 0;
+
+  if (++conn->requests >= http_keep_alive_max_requests || http_keep_alive_timeout <= 0)
+    conn->keep_alive = 0;
+  return 0;
+}
+
+int http_conn_ready(struct http_conn *conn) {
+  if (conn->error)
+    return -1;
+  if (conn->state == PARSE_DONE) {
+    if (!conn->claimed)
+      return 1;
+    http_conn_advance(conn);
+  }
+  if (conn->discard > 0)
+    return 0;
+
+  struct http_request *request = &conn->request;
+  char *arena = conn->arena;
+  size_t used = conn->arena_used;
+
+  /* Resume where the last call stopped; every byte is looked at once */
+  while (conn->scanned < conn->len && conn->state != PARSE_DONE) {
+    char c = conn->buf[conn->scanned++];
+
+    switch (conn->state) {
+      case PARSE_START:
+        if (c == '\r' || c == '\n')
+          break;
+        conn->state = PARSE_METHOD;
+        request->method = arena + used;
+        /* Fall through */
+      case PARSE_METHOD:
+        if (c >= 'A' && c <= 'Z') {
+          arena[used++] = c;
+        } else if (c == ' ' && arena + used > request->method) {
+          arena[used++] = '\0';
+          request->path = arena + used;
+          conn->state = PARSE_PATH;
+        } else {
+          conn->error = 400;
+        }
+        break;
+
+      case PARSE_PATH:
+        if (c == ' ' || c == '\n') {
+          if (arena + used == request->path) {
+            conn->error = 400;
+            break;
+          }
+          arena[used++] = '\0';
+          request->version = arena + used;
+          if (c == ' ') {
+            conn->state = PARSE_VERSION;
+          } else {
+            /* No version at all */
+            arena[used++] = '\0';
+            conn->state = PARSE_HEADER_START;
+          }
+        } else if (c == '\r') {
+          break;
+        } else if ((unsigned char) c < ' ' || c == 0x7f) {
+          conn->error = 400;
+        } else {
+          arena[used++] = c;
+        }
+        break;
+
+      case PARSE_VERSION:
+        if (c == '\n') {
+          arena[used++] = '\0';
+          conn->state = PARSE_HEADER_START;
+        } else if (c != '\r') {
+          arena[used++] = c;
+        }
+        break;
+
+      case PARSE_HEADER_START:
+        if (c == '\r')
+          break;
+        if (c == '\n') {
+          conn->state = PARSE_DONE;
+          break;
+        }
+        if (request->num_headers == LIBHTTP_MAX_HEADERS) {
+          conn->error = 431;
+          break;
+        }
+        request->headers[request->num_headers].name = arena + used;
+        conn->state = PARSE_HEADER_NAME;
+        /* Fall through */
+      case PARSE_HEADER_NAME:
+        if (c == ':') {
+          arena[used++] = '\0';
+          request->headers[request->num_headers].value = arena + used;
+          conn->state = PARSE_HEADER_SPACE;
+        } else if (c == '\n' || c == '\r') {
+          conn->error = 400;
+        } else {
+          arena[used++] = c;
+        }
+        break;
+
+      case PARSE_HEADER_SPACE:
+        if (c == ' ' || c == '\t')
+          break;
+        conn->state = PARSE_HEADER_VALUE;
+        /* Fall through */
+      case PARSE_HEADER_VALUE:
+        if (c == '\n') {
+          /* Trim trailing whitespace */
+          char *value = request->headers[request->num_headers].value;
+          while (arena + used > value && (arena[used-1] == ' ' || arena[used-1] == '\t'))
+            used--;
+          arena[used++] = '\0';
+          request->num_headers++;
+          conn->state = PARSE_HEADER_START;
+        } else if (c != '\r') {
+          arena[used++] = c;
+        }
+        break;
+    }
+
+    if (conn->error)
+      break;
+  }
+  conn->arena_used = used;
+
+  if (conn->state == PARSE_DONE)
+    return http_conn_finish_head(conn) == -1 ? -1 : 1;
+  if (!conn->error && conn->len >= LIBHTTP_REQUEST_MAX_SIZE)
+    conn->error = 431;
+  return conn->error ? -1 : 0;
+}
+
+int http_conn_wait(struct http_conn *conn) {
+  int ready;
+  while ((ready = http_conn_ready(conn)) == 0) {
+    struct pollfd pfd = { .fd = conn->fd, .events = POLLIN };
+    int rc = poll(&pfd, 1, http_keep_alive_timeout * 1000);
+    if (rc < 0 && errno == EINTR)
+      continue;
+    if (rc <= 0)
+      return 0;
+
+    ssize_t bytes_read = http_conn_fill(conn);
+    if (bytes_read < 0 && errno == EAGAIN)
+      continue;
+    if (bytes_read <= 0)
+      return 0;
+  }
+  return 1;
+}
+
+void http_reject(struct http_conn *conn) {
+  char response[256];
+  int length = snprintf(response, sizeof(response),
+      "HTTP/1.1 %d %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n",
+      conn->error, http_get_response_message(conn->error));
+  send(conn->fd, response, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+void http_close(int fd) {
+  if (fd >= 0 && (size_t) fd < http_conns_size && http_conns[fd]) {
+    /* Best effort for a response that never sent a body or flushed */
+    struct http_conn *conn = http_conns[fd];
+    if (conn->head_len > 0)
+      send(fd, conn->head, conn->head_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    http_conns[fd] = NULL;
+
+    pthread_mutex_lock(&http_conn_pool_lock);
+    if (http_conn_pool_len < LIBHTTP_CONN_POOL_SIZE) {
+      http_conn_pool[http_conn_pool_len++] = conn;
+      conn = NULL;
+    }
+    pthread_mutex_unlock(&http_conn_pool_lock);
+    free(conn);
+  }
+  close(fd);
+}
+
+struct http_request *http_request_parse(int fd) {
+  struct http_conn *conn = http_conn_get(fd);
+  if (!conn) return NULL;
+
+  /* Read until the whole request head is parsed (the event loop, or a
+   * previous pipelined read, may already have done this for us). The head
+   * has to arrive by the same deadline the event loop gives it, so a client
+   * that sends nothing doesn't hold the worker. */
+  time_t deadline = time(NULL) + (http_keep_alive_timeout > 0 ?
+      http_keep_alive_timeout : LIBHTTP_REQUEST_TIMEOUT);
+  int ready;
+  while ((ready = http_conn_ready(conn)) == 0) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    time_t left = deadline - time(NULL);
+    int rc = left > 0 ? poll(&pfd, 1, left * 1000) : 0;
+    if (rc < 0 && errno == EINTR)
+      continue;
+    if (rc <= 0)
+      break;
+
+    ssize_t bytes_read = http_conn_fill(conn);
+    if (bytes_read < 0 && errno == EAGAIN)
+      continue;
+    if (bytes_read <= 0) {
+      /* A client that leaves between requests is not an error */
+      if (conn->len > 0 && conn->state != PARSE_START)
+        conn->error = 400;
+      break;
+    }
+  }
+
+  if (ready <= 0) {
+    conn->keep_alive = 0;
+    return NULL;
+  }
+
+  conn->claimed = 1;
+  return &conn->request;
+}
+
+/* A block of scratch memory; the first LIBHTTP_SCRATCH_BLOCK_SIZE one is
+ * kept for the life of the thread */
+struct http_scratch_block {
+  struct http_scratch_block *next;
+  size_t size;
+  size_t used;
+  char data[] __attribute__((aligned(16)));
+};
+
+static __thread struct http_scratch_block *http_scratch_blocks;
+static __thread struct http_scratch_block *http_scratch_current;
+static pthread_key_t http_scratch_key;
+static pthread_once_t http_scratch_once = PTHREAD_ONCE_INIT;
+
+/* Give a thread's blocks back when it exits */
+static void http_scratch_free(void *blocks) {
+  struct http_scratch_block *block = blocks, *next;
+  for (; block != NULL; block = next) {
+    next = block->next;
+    free(block);
+  }
+}
+
+static void http_scratch_init(void) {
+  pthread_key_create(&http_scratch_key, http_scratch_free);
+}
+
+void *http_scratch_alloc(size_t size) {
+  struct http_scratch_block *block = http_scratch_current, **link;
+
+  size = (size + 15) & ~(size_t) 15;
+  while (block != NULL && block->used + size > block->size)
+    block = block->next;
+
+  if (block == NULL) {
+    /* Out of room: add a block at the end, big enough for SIZE */
+    size_t block_size = size > LIBHTTP_SCRATCH_BLOCK_SIZE ? size : LIBHTTP_SCRATCH_BLOCK_SIZE;
+    if ((block = malloc(sizeof(struct http_scratch_block) + block_size)) == NULL)
+      return NULL;
+    block->next = NULL;
+    block->size = block_size;
+    block->used = 0;
+    for (link = &http_scratch_blocks; *link != NULL; link = &(*link)->next)
+      ;
+    *link = block;
+    if (http_scratch_blocks == block) {
+      pthread_once(&http_scratch_once, http_scratch_init);
+      pthread_setspecific(http_scratch_key, block);
+    }
+  }
+
+  http_scratch_current = block;
+  block->used += size;
+  return block->data + block->used - size;
+}
+
+void http_scratch_reset(void) {
+  struct http_scratch_block *block, **link = &http_scratch_blocks;
+  int allocated = http_scratch_blocks != NULL;
+
+  /* One-off large blocks don't stay around */
+  while ((block = *link) != NULL) {
+    if (block->size > LIBHTTP_SCRATCH_BLOCK_SIZE) {
+      *link = block->next;
+      free(block);
+      continue;
+    }
+    block->used = 0;
+    link = &block->next;
+  }
+  http_scratch_current = http_scratch_blocks;
+  if (allocated)
+    pthread_setspecific(http_scratch_key, http_scratch_blocks);
+}
+
+char *http_get_response_message(int status_code) {
   switch (status_code) {
     case 100:
       return "Continue";
     case 200:
       return "OK";
+    case 206:
+      return "Partial Content";
     case 301:
       return "Moved Permanently";
     case 302:
@@ -93,22 +709,169 @@ char* http_get_response_message(int status_code) {
       return "Not Found";
     case 405:
       return "Method Not Allowed";
+    case 413:
+      return "Payload Too Large";
+    case 416:
+      return "Range Not Satisfiable";
+    case 431:
+      return "Request Header Fields Too Large";
+    case 502:
+      return "Bad Gateway";
+    case 503:
+      return "Service Unavailable";
     default:
       return "Internal Server Error";
   }
 }
 
+/* Status lines, formatted once; indexed by status code */
+#define LIBHTTP_MIN_STATUS 100
+#define LIBHTTP_MAX_STATUS 599
+
+static struct {
+  char *line;
+  size_t len;
+} http_status_lines[LIBHTTP_MAX_STATUS + 1];
+static pthread_once_t http_status_once = PTHREAD_ONCE_INIT;
+
+static void http_status_init(void) {
+  int code;
+  for (code = LIBHTTP_MIN_STATUS; code <= LIBHTTP_MAX_STATUS; code++) {
+    int len = asprintf(&http_status_lines[code].line, "HTTP/1.1 %d %s\r\n", code,
+        http_get_response_message(code));
+    if (len < 0) http_fatal_error("Malloc failed");
+    http_status_lines[code].len = len;
+  }
+}
+
+#define HTTP_KEEP_ALIVE_END "Connection: keep-alive\r\n\r\n"
+#define HTTP_CLOSE_END "Connection: close\r\n\r\n"
+
+int http_wait_writable(int fd) {
+  struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+  int rc = 0;
+
+  /* A blocking socket only fails with EAGAIN once SO_SNDTIMEO has run out */
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags == -1 || (flags & O_NONBLOCK)) {
+    while ((rc = poll(&pfd, 1, http_send_timeout * 1000)) < 0 && errno == EINTR)
+      ;
+  }
+  if (rc <= 0) {
+    shutdown(fd, SHUT_RDWR);
+    return -1;
+  }
+  return 0;
+}
+
+/* Send all of IOV, picking up after partial writes. Returns -1 on error. */
+static int http_sendmsg(int fd, struct iovec *iov, int iovcnt, int flags) {
+  struct http_conn *conn = http_conn_find(fd);
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+
+  while (iovcnt > 0) {
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    ssize_t bytes_sent = sendmsg(fd, &msg, flags | MSG_NOSIGNAL);
+    if (bytes_sent < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN && http_wait_writable(fd) == 0)
+        continue;
+      return -1;
+    }
+    if (conn != NULL)
+      conn->bytes_sent += bytes_sent;
+
+    /* Skip what went out; the rest of a partly sent buffer goes next */
+    while (iovcnt > 0 && (size_t) bytes_sent >= iov->iov_len) {
+      bytes_sent -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *) iov->iov_base + bytes_sent;
+      iov->iov_len -= bytes_sent;
+    }
+  }
+  return 0;
+}
+
+/* Append to the response head, sending it first if it would overflow */
+static void http_head_append(int fd, const char *data, size_t size) {
+  struct http_conn *conn = http_conn_find(fd);
+  struct iovec iov = { .iov_base = (void *) data, .iov_len = size };
+  if (conn == NULL) {
+    http_sendmsg(fd, &iov, 1, 0);
+    return;
+  }
+
+  if (conn->head_len + size > sizeof(conn->head)) {
+    http_flush(fd);
+    if (size > sizeof(conn->head)) {
+      http_sendmsg(fd, &iov, 1, 0);
+      return;
+    }
+  }
+  memcpy(conn->head + conn->head_len, data, size);
+  conn->head_len += size;
+}
+
+int http_flush(int fd) {
+  struct http_conn *conn = http_conn_find(fd);
+  if (conn == NULL || conn->head_len == 0)
+    return 0;
+
+  struct iovec iov = { .iov_base = conn->head, .iov_len = conn->head_len };
+  conn->head_len = 0;
+  return http_sendmsg(fd, &iov, 1, 0);
+}
+
 void http_start_response(int fd, int status_code) {
-  dprintf(fd, "HTTP/1.0 %d %s\r\n", status_code,
-      http_get_response_message(status_code));
+  pthread_once(&http_status_once, http_status_init);
+
+  /* Anything left of an earlier response goes out before this one */
+  http_flush(fd);
+  if (status_code < LIBHTTP_MIN_STATUS || status_code > LIBHTTP_MAX_STATUS)
+    status_code = 500;
+  struct http_conn *conn = http_conn_find(fd);
+  if (conn != NULL) {
+    conn->status = status_code;
+    conn->bytes_sent = 0;
+  }
+  http_head_append(fd, http_status_lines[status_code].line,
+      http_status_lines[status_code].len);
 }
 
 void http_send_header(int fd, char *key, char *value) {
-  dprintf(fd, "%s: %s\r\n", key, value);
+  size_t key_len = strlen(key), value_len = strlen(value);
+  char line[256];
+
+  if (key_len + value_len + 4 > sizeof(line)) {
+    http_head_append(fd, key, key_len);
+    http_head_append(fd, ": ", 2);
+    http_head_append(fd, value, value_len);
+    http_head_append(fd, "\r\n", 2);
+    return;
+  }
+  memcpy(line, key, key_len);
+  memcpy(line + key_len, ": ", 2);
+  memcpy(line + key_len + 2, value, value_len);
+  memcpy(line + key_len + 2 + value_len, "\r\n", 2);
+  http_head_append(fd, line, key_len + value_len + 4);
+}
+
+void http_send_headers(int fd, char *headers, size_t size) {
+  http_head_append(fd, headers, size);
 }
 
 void http_end_headers(int fd) {
-  dprintf(fd, "\r\n");
+  struct http_conn *conn = http_conn_find(fd);
+  if (conn && conn->keep_alive)
+    http_head_append(fd, HTTP_KEEP_ALIVE_END, sizeof(HTTP_KEEP_ALIVE_END) - 1);
+  else
+    http_head_append(fd, HTTP_CLOSE_END, sizeof(HTTP_CLOSE_END) - 1);
 }
 
 void http_send_string(int fd, char *data) {
@@ -116,14 +879,97 @@ void http_send_string(int fd, char *data) {
 }
 
 void http_send_data(int fd, char *data, size_t size) {
-  ssize_t bytes_sent;
+  struct http_conn *conn = http_conn_find(fd);
+  struct iovec iov[2];
+  int iovcnt = 0;
+
+  /* The buffered head and the body leave in one sendmsg() */
+  if (conn != NULL && conn->head_len > 0) {
+    iov[iovcnt].iov_base = conn->head;
+    iov[iovcnt++].iov_len = conn->head_len;
+    conn->head_len = 0;
+  }
+  if (size > 0) {
+    iov[iovcnt].iov_base = data;
+    iov[iovcnt++].iov_len = size;
+  }
+  http_sendmsg(fd, iov, iovcnt, 0);
+}
+
+void http_send_chunk(int fd, char *data, size_t size) {
+  struct http_conn *conn = http_conn_find(fd);
+  struct iovec iov[4];
+  int iovcnt = 0;
+  char size_line[24];
+
+  if (conn != NULL && conn->head_len > 0) {
+    iov[iovcnt].iov_base = conn->head;
+    iov[iovcnt++].iov_len = conn->head_len;
+    conn->head_len = 0;
+  }
+  iov[iovcnt].iov_base = size_line;
+  iov[iovcnt++].iov_len = snprintf(size_line, sizeof(size_line), "%zx\r\n", size);
+  if (size > 0) {
+    iov[iovcnt].iov_base = data;
+    iov[iovcnt++].iov_len = size;
+  }
+  iov[iovcnt].iov_base = "\r\n";
+  iov[iovcnt++].iov_len = 2;
+  /* Hold partial packets until the last chunk, which would otherwise wait
+   * for the client's delayed ACK of the one before */
+  http_sendmsg(fd, iov, iovcnt, size > 0 ? MSG_MORE : 0);
+}
+
+/* Fallback for http_send_file when sendfile() can't be used on FILE_FD. */
+static int http_copy_file(int fd, int file_fd, off_t offset, size_t size) {
+  char buf[LIBHTTP_COPY_BUFFER_SIZE];
   while (size > 0) {
-    bytes_sent = write(fd, data, size);
-    if (bytes_sent < 0)
-      return;
+    size_t want = size < sizeof(buf) ? size : sizeof(buf);
+    ssize_t bytes_read = pread(file_fd, buf, want, offset);
+    if (bytes_read < 0 && errno == EINTR)
+      continue;
+    if (bytes_read <= 0)
+      return -1;
+    http_send_data(fd, buf, bytes_read);
+    offset += bytes_read;
+    size -= bytes_read;
+  }
+  return 0;
+}
+
+int http_send_file(int fd, int file_fd, off_t offset, size_t size) {
+  /* MSG_MORE lets the head share its packet with the start of the file */
+  struct http_conn *conn = http_conn_find(fd);
+  if (conn != NULL && conn->head_len > 0) {
+    struct iovec iov = { .iov_base = conn->head, .iov_len = conn->head_len };
+    conn->head_len = 0;
+    if (http_sendmsg(fd, &iov, 1, size > 0 ? MSG_MORE : 0) < 0)
+      return -1;
+  }
+
+  while (size > 0) {
+    size_t chunk = size < LIBHTTP_SENDFILE_CHUNK ? size : LIBHTTP_SENDFILE_CHUNK;
+    ssize_t bytes_sent = sendfile(fd, file_fd, &offset, chunk);
+    if (bytes_sent < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN) {
+        if (http_wait_writable(fd) < 0)
+          return -1;
+        continue;
+      }
+      if (errno == EINVAL || errno == ENOSYS)
+        return http_copy_file(fd, file_fd, offset, size);
+      return -1;
+    }
+    /* The file got shorter after we sent Content-Length. */
+    if (bytes_sent == 0)
+      return -1;
+    if (conn != NULL)
+      conn->bytes_sent += bytes_sent;
     size -= bytes_sent;
-    data += bytes_sent;
   }
+  return 0;
 }
 
 char *http_get_mime_type(char *file_name) {
@@ -149,152 +995,109 @@ char *http_get_mime_type(char *file_name) {
   }
 }
 
-/* Check directory or not */
-int check_directory(char *dir_name) {
-    struct stat dir_stat;
-    if(stat(dir_name, &dir_stat) == -1) {
-      fprintf(stderr, "Check directory %s : %s\n", dir_name, strerror(errno));
-      return 0;
-    }
-    return S_ISDIR(dir_stat.st_mode);
+int http_mime_compressible(char *mime_type) {
+  return strncmp(mime_type, "text/", 5) == 0 ||
+    strcmp(mime_type, "application/javascript") == 0;
 }
 
-/* Check file or not */
-int check_file(char *file_name) {
-  struct stat f_info;
-  if(stat(file_name, &f_info) == -1) {
-    fprintf(stderr, "Check file %s : %s\n", file_name, strerror(errno));
-    return 0;
-  }
-  return S_ISREG(f_info.st_mode);
-}
-
-/* Check whether contains index.html */
-int contain_file(char *file_path) {
-  char *f_n;
-  if((f_n=(char*)malloc(sizeof(char*)*(strlen(file_path) + strlen("index.html")+2))) == NULL) {
-    fprintf(stderr, "%s\n", strerror((errno)));
-    return 0;
-  }
-
-  strcpy(f_n, file_path);
-  strcat(f_n, "index.html");
-        
-  if(check_file(f_n)) {
-    full_file_name = (char*) malloc(sizeof(char*)*(strlen(f_n)+1));
-    full_file_name = strdup(f_n);
-    free(f_n);
-    return 1;
-  }
-  return 0;
-}
-
-/* Read whole path starting from directory */
-char *read_path(char *directory, char* path) {
+/* Resolve PATH under DIRECTORY to what should be served: a regular file, the
+ * index.html of a directory, or the directory itself (to be listed). Returns
+ * the full path, from scratch memory, and fills FILE_STAT, or NULL if there
+ * is nothing to serve. */
+char *resolve_path(char *directory, char *path, struct stat *file_stat) {
+  size_t dir_len = strlen(directory), path_len = strlen(path);
   char *full_path;
-  if((full_path = (char *)malloc(sizeof(char)*(strlen(path)+strlen(directory)+2))) == NULL) {
+  if((full_path = http_scratch_alloc(dir_len + path_len + strlen("index.html") + 1)) == NULL) {
     fprintf(stderr, "%s\n", strerror(errno));
     return NULL;
   }
 
-  strcpy(full_path, directory);
-  strcat(full_path, path);
+  memcpy(full_path, directory, dir_len);
+  memcpy(full_path + dir_len, path, path_len + 1);
 
-  char last_char = full_path[strlen(full_path)-1];
-
-  if(last_char == '/') {
-    /* Directory */
-    if(check_directory(full_path)) {
-      /* Check for file */
-      if(contain_file(full_path)) {
-        /* Return file content */
-        free(full_path);
-        return get_content_string(full_file_name);
-      } else {
-        /* Directory exist, but file not found */
-        return read_directory(full_path);
-      }
-    } else {
-      /* Directory not exist */
-      return NULL;
-    }
+  if(stat(full_path, file_stat) == -1) {
+    /* Nothing there */
+    return NULL;
   }
 
-  if(check_file(full_path)) {
-    /* File found */
-    if((full_file_name = (char*)malloc(sizeof(char)*(strlen(full_path)+1))) == NULL) {
-      fprintf(stderr, "%s\n", strerror(errno));
-      return NULL;
-    }
+  if(S_ISREG(file_stat->st_mode))
+    return full_path;
 
-    strcpy(full_file_name, full_path);
-    return get_content_string(full_file_name);
-  } else {
-    /* File not found */
-    return NULL;
+  if(S_ISDIR(file_stat->st_mode) && path_len > 0 && path[path_len-1] == '/') {
+    /* Directory: prefer its index.html, otherwise list it */
+    struct stat index_stat;
+    strcpy(full_path + dir_len + path_len, "index.html");
+    if(stat(full_path, &index_stat) == 0 && S_ISREG(index_stat.st_mode)) {
+      *file_stat = index_stat;
+      return full_path;
+    }
+    full_path[dir_len + path_len] = '\0';
+    return full_path;
   }
 
   return NULL;
 }
 
-/* Read files/directories from directory */
-char *read_directory(char *dir_name) {
-  DIR *dir;
+/* What getdents64 fills the buffer with */
+struct http_dirent {
+  ino64_t d_ino;
+  off64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
 
-  if((dir = opendir(dir_name)) == NULL) {
+int http_listing_open(struct http_listing *listing, char *dir_name) {
+  listing->dir_fd = open(dir_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  listing->entries = http_scratch_alloc(LIBHTTP_LISTING_BUFFER_SIZE);
+  if (listing->dir_fd == -1 || listing->entries == NULL) {
     fprintf(stderr, "Error in openning directory : %s\n", strerror(errno));
-    return NULL;
+    if (listing->dir_fd != -1)
+      close(listing->dir_fd);
+    return -1;
   }
-  
-  char *str = (char*)malloc(1024);
-  if(str == NULL) {
-    fprintf(stderr, "%s\n", strerror(errno));
-    return NULL;
+  listing->dir_name = dir_name;
+  listing->started = 0;
+  listing->entries_len = 0;
+  listing->next = 0;
+  return 0;
+}
+
+size_t http_listing_read(struct http_listing *listing, char *buf, size_t size) {
+  size_t used = 0;
+  int len;
+
+  if (!listing->started) {
+    len = snprintf(buf, size, " Index of %s <br> ", listing->dir_name);
+    if (len < 0 || (size_t) len >= size)
+      return 0;
+    used = len;
+    listing->started = 1;
   }
-  
-  struct dirent *d;
-  
-  char *s = (char *)malloc(1024);
-  sprintf(s, " Index of %s <br> ", dir_name);
-  strcpy(str, s);
-  free(s);
-  while((d = readdir(dir)) != 0) {
-    s = (char *)malloc(1024);
-    if(strcmp(d->d_name, "..") == 0)
-      sprintf(s, " <a href=\"%s\"> %s </a> <br> ", d->d_name ,"Parent Directory");
-    else
-      sprintf(s, " <a href=\"%s\"> %s </a> <br> ", d->d_name ,d->d_name);
-    strcat(str, s);
-    free(s);
-  }
-
-  closedir(dir);
-    
-  return str;
-}
-
-/* Content length of file */
-size_t get_content_length(char *file_name) {
-   struct stat f_info;
-   if(stat(file_name, &f_info) == -1) {
-    fprintf(stderr, "Get content length %s : %s\n", file_name, strerror(errno));
-    return 0;
+
+  /* Whole entries only; one that doesn't fit waits for the next call */
+  while (1) {
+    if (listing->next >= listing->entries_len) {
+      long bytes_read = syscall(SYS_getdents64, listing->dir_fd, listing->entries,
+          LIBHTTP_LISTING_BUFFER_SIZE);
+      if (bytes_read <= 0)
+        break;
+      listing->entries_len = bytes_read;
+      listing->next = 0;
+    }
+
+    struct http_dirent *entry = (struct http_dirent *) (listing->entries + listing->next);
+    char *name = entry->d_name;
+    len = snprintf(buf + used, size - used, " <a href=\"%s\"> %s </a> <br> ", name,
+        strcmp(name, "..") == 0 ? "Parent Directory" : name);
+    if (len < 0 || (size_t) len >= size - used)
+      break;
+    used += len;
+    listing->next += entry->d_reclen;
   }
-  return f_info.st_size;
+  return used;
 }
 
-/* Content of a file */
-char* get_content_string(char *file_name) {
-  size_t length = get_content_length(file_name);
-  FILE *fp = fopen(file_name, "r");
-  if(fp == NULL) {
-    fprintf(stderr, "Error in opening file : %s\n", strerror(errno));
-    return NULL;
-  }
-  char *str = malloc(length);
-  if(fread(str, 1, length, fp) < length) {
-      fprintf(stderr, "ERROR: failed to read file\n");
-      return NULL;
-   }
-   return str;
-}
\ No newline at end of file
+void http_listing_close(struct http_listing *listing) {
+  close(listing->dir_fd);
+}
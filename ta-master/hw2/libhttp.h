@@ -11,59 +11,256 @@
  *     http_start_response(fd, 200);
  *     http_send_header(fd, "Content-type", http_get_mime_type("index.html"));
  *     http_send_header(fd, "Server", "httpserver/1.0");
- *     http_end_headers(fd);
+ *     http_send_header(fd, "Content-Length", "47");
+ *     http_end_headers(fd);  // Also sends "Connection: keep-alive/close"
  *     http_send_string(fd, "<html><body><a href='/'>Home</a></body></html>");
  *
- *     close(fd);
+ *     http_close(fd);
  */
 
 #ifndef LIBHTTP_H
 #define LIBHTTP_H
 
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define LIBHTTP_REQUEST_MAX_SIZE 8192
+#define LIBHTTP_MAX_HEADERS 64
+
+/* Room for a response's status line and headers, which are collected here
+ * and go out together with the start of the body */
+#define LIBHTTP_RESPONSE_HEAD_SIZE 2048
+
+/* Most parts of a Range header we are willing to serve */
+#define LIBHTTP_MAX_RANGES 16
+
+/* Longest line of a directory listing: two copies of a NAME_MAX name */
+#define LIBHTTP_LISTING_ENTRY_MAX 1024
+
+/* Bytes of raw directory entries read at a time for a listing */
+#define LIBHTTP_LISTING_BUFFER_SIZE 32768
+
+/* Closed connections whose state is kept for the next ones */
+#define LIBHTTP_CONN_POOL_SIZE 256
+
+/* Seconds a client gets to send its first request when keep-alive is off */
+#define LIBHTTP_REQUEST_TIMEOUT 10
+
 /*
  * Functions for parsing an HTTP request.
+ *
+ * All strings point into the connection's arena and stay valid until the
+ * next request on the same connection is parsed. Nothing needs to be freed.
  */
+struct http_header {
+  char *name;
+  char *value;
+};
+
 struct http_request {
   char *method;
   char *path;
+  char *version;
+  int num_headers;
+  struct http_header headers[LIBHTTP_MAX_HEADERS];
 };
 
-char* full_file_name;
+/* Returns NULL if an error was encountered; the status code to answer with
+ * is then in the connection's error field (0 if the client just left or
+ * sent no whole request head within http_keep_alive_timeout). */
 struct http_request *http_request_parse(int fd);
 
+/* Value of header NAME (case-insensitive), or NULL if it wasn't sent. */
+char *http_get_header(struct http_request *request, char *name);
+
+/*
+ * Per-connection state. Bytes read from a socket are kept in buf and parsed
+ * incrementally, so a request can be read piecewise by the event loop and
+ * handed to a worker thread once it is complete. The parsed request's
+ * strings are copied into arena, leaving buf untouched for proxying.
+ */
+struct http_conn {
+  int fd;
+  struct sockaddr_in peer;  // Client address, zero unless the accept path set it
+  size_t len;
+  size_t discard;     // Body bytes of the last request still to be skipped
+  int keep_alive;     // Whether the connection stays open after this response
+  int requests;       // Requests parsed on this connection so far
+  int error;          // Status code for a request that failed to parse
+
+  /* Parser state, resumed on every call to http_conn_ready */
+  int state;
+  size_t scanned;     // Bytes of buf already fed to the parser
+  size_t arena_used;
+  size_t content_length;
+  int claimed;        // The parsed request was handed out
+  struct http_request request;
+
+  size_t head_len;    // Bytes of head not sent yet
+  int status;         // Status code of the response being sent, 0 before it starts
+  size_t bytes_sent;  // Of that response so far, head included
+
+  char buf[LIBHTTP_REQUEST_MAX_SIZE + 1];
+  char head[LIBHTTP_RESPONSE_HEAD_SIZE];
+  char arena[LIBHTTP_REQUEST_MAX_SIZE + LIBHTTP_MAX_HEADERS * 2 + 4];
+};
+
+/* Keep-alive policy: seconds an idle connection is kept open (0 disables
+ * keep-alive) and the number of requests served before closing it. */
+extern int http_keep_alive_timeout;
+extern int http_keep_alive_max_requests;
+
+/* Seconds a response may go without the client taking any of it before the
+ * connection is given up on. */
+extern int http_send_timeout;
+
+/* Returns the buffer for FD, creating it if needed. */
+struct http_conn *http_conn_get(int fd);
+
+/* Reads once from the socket into the buffer. Returns read()'s result. */
+ssize_t http_conn_fill(struct http_conn *conn);
+
+/* Feeds newly buffered bytes to the parser. 1 if a whole request head has
+ * been parsed, 0 if more is needed, -1 if the request is malformed or larger
+ * than LIBHTTP_REQUEST_MAX_SIZE (the status code is left in error). */
+int http_conn_ready(struct http_conn *conn);
+
+/* Waits up to http_keep_alive_timeout for the next request on a kept-alive
+ * connection. Returns 1 once a request head is buffered, 0 on timeout or EOF. */
+int http_conn_wait(struct http_conn *conn);
+
+/* Best-effort error response for a request that failed to parse, sent
+ * without blocking (for the event loop). */
+void http_reject(struct http_conn *conn);
+
+/* Frees the connection's buffer and closes FD. */
+void http_close(int fd);
+
+/* A byte range of a body, from first to last inclusive */
+struct http_range {
+  off_t first;
+  off_t last;
+};
+
+/*
+ * Parses a Range header for a body of SIZE bytes into at most MAX_RANGES
+ * ranges, clipped to the body. Returns how many ranges are satisfiable (0
+ * means 416), or -1 if the header is malformed or asks for too many parts
+ * and should be ignored.
+ */
+int http_parse_ranges(char *header, off_t size, struct http_range *ranges, int max_ranges);
+
+/* Validators of a file, sent as ETag and Last-Modified */
+struct http_validators {
+  char etag[64];
+  char last_modified[32];
+  time_t mtime;
+};
+
+/* Derives a file's validators from its stat data alone. ENCODING is the
+ * Content-Encoding the file is sent with, or NULL. */
+void http_make_validators(struct http_validators *validators, ino_t ino, off_t size,
+    struct timespec *mtime, char *encoding);
+
+/* Whether the request's Accept-Encoding allows ENCODING (like "gzip"). */
+int http_accepts_encoding(struct http_request *request, char *encoding);
+
+/* Whether the request's If-None-Match (or, without it, If-Modified-Since)
+ * shows the client already has this version of the file: answer 304. */
+int http_not_modified(struct http_request *request, struct http_validators *validators);
+
+/* Whether a Range request may be served: true unless an If-Range header
+ * names a different version of the file. */
+int http_if_range(struct http_request *request, struct http_validators *validators);
+
 /*
- * Functions for sending an HTTP response.
+ * Scratch memory for the request a thread is handling. Allocations are
+ * bumped out of blocks the thread keeps, and all of them are released at
+ * once by http_scratch_reset when the request is done, so nothing is freed
+ * one by one and a steady stream of requests allocates nothing from the heap.
  */
+#define LIBHTTP_SCRATCH_BLOCK_SIZE 65536
+
+/* Returns SIZE bytes valid until the next http_scratch_reset on this thread,
+ * or NULL if memory is exhausted. */
+void *http_scratch_alloc(size_t size);
+
+/* Releases everything allocated on this thread; blocks larger than
+ * LIBHTTP_SCRATCH_BLOCK_SIZE go back to the heap. */
+void http_scratch_reset(void);
+
+/*
+ * Functions for sending an HTTP response. The status line and headers are
+ * only buffered; they go out in the same sendmsg() as the first body bytes
+ * (or ahead of sendfile() with MSG_MORE), so a small response costs a single
+ * syscall. A response without a body must end with http_flush.
+ */
+char *http_get_response_message(int status_code);
 void http_start_response(int fd, int status_code);
 void http_send_header(int fd, char *key, char *value);
+
+/* Adds preformatted "Name: value\r\n" lines to the response head. */
+void http_send_headers(int fd, char *headers, size_t size);
 void http_end_headers(int fd);
 void http_send_string(int fd, char *data);
 void http_send_data(int fd, char *data, size_t size);
 
+/* Sends SIZE bytes as one chunk of a "Transfer-Encoding: chunked" body;
+ * SIZE 0 sends the last chunk, ending the body. */
+void http_send_chunk(int fd, char *data, size_t size);
+
+/* Sends whatever of the response head is still buffered. Returns 0 on
+ * success, -1 if the client went away. */
+int http_flush(int fd);
+
+/* Waits up to http_send_timeout for FD to take more data, after a send to it
+ * failed with EAGAIN. Returns -1 if it didn't, with the connection shut
+ * down so that later sends fail at once. */
+int http_wait_writable(int fd);
+
+/*
+ * Sends SIZE bytes of FILE_FD starting at OFFSET without copying them through
+ * user memory. Returns 0 on success, -1 if the client went away or the file
+ * could not be read.
+ */
+int http_send_file(int fd, int file_fd, off_t offset, size_t size);
+
 /*
  * Helper function: gets the Content-Type based on a file name.
  */
 char *http_get_mime_type(char *file_name);
 
-/* Check directory or not */
-int check_directory(char *dir_name);
-
-/* Check file or not */
-int check_file(char *name);
+/* Whether a body of MIME_TYPE is worth compressing. */
+int http_mime_compressible(char *mime_type);
 
-/* Check whether contains index.html */
-int contain_file(char *file_path);
+/* Resolve a request path to the file or directory to serve. The name is
+ * allocated from the request's scratch memory. */
+char *resolve_path(char *directory, char *path, struct stat *file_stat);
 
-/* Read files/directories from directory */
-char *read_directory(char *dir_name);
+/*
+ * Generates the HTML listing of a directory a few entries at a time, so a
+ * directory of any size is listed with one fixed-size buffer.
+ */
+struct http_listing {
+  int dir_fd;
+  char *dir_name;
+  int started;              // The title has been written
+  char *entries;            // Raw directory entries, from scratch memory
+  size_t entries_len;
+  size_t next;              // Offset of the first entry not yet listed
+};
 
-/* Read whole path starting from directory */
-char *read_path(char*, char*);
+/* Returns 0, or -1 if DIR_NAME can't be read. Entries are read into
+ * scratch memory, so the listing must end with the request. */
+int http_listing_open(struct http_listing *listing, char *dir_name);
 
-/* content length of file */
-size_t get_content_length(char *file_name);
+/* Fills BUF with the next whole entries of the listing, returning how many
+ * bytes were written; 0 once the listing is complete. SIZE must fit at least
+ * one entry (LIBHTTP_LISTING_ENTRY_MAX). */
+size_t http_listing_read(struct http_listing *listing, char *buf, size_t size);
 
-/* Content of a file */
-char* get_content_string(char *file_name);
+void http_listing_close(struct http_listing *listing);
 
 #endif
@@ -0,0 +1,673 @@
+/*
+ * Load generator for httpserver. Each thread drives many connections from
+ * one epoll instance and records the latency of every response in an
+ * HDR-style histogram (see metrics.h); the report gives throughput and
+ * latency percentiles.
+ *
+ * Closed loop (the default): every connection sends its next request as
+ * soon as the last response is in, finding the most the server can do.
+ * Open loop (--rate): requests fall due at a fixed rate whether or not the
+ * server keeps up, and latency counts from when a request was due, so a
+ * stalled server shows in the percentiles instead of just slowing the
+ * generator down.
+ *
+ * The mix is a list of weighted paths, e.g. /index.html:8,/my_documents/:1
+ * for mostly files with some directory listings. To load the proxy, run a
+ * stub upstream and put the server in front of it:
+ *
+ *     ./loadgen --stub 9000 --stub-size 4096 &
+ *     ./httpserver --proxy 127.0.0.1:9000 --port 8000 --num-threads 4 &
+ *     ./loadgen --port 8000 --connections 256 --duration 10
+ *
+ * Usage: ./loadgen [--host 127.0.0.1] [--port 8000] [--connections 64]
+ *            [--threads 1] [--duration 10] [--rate 0] [--mix /]
+ *            [--no-keep-alive]
+ *        ./loadgen --stub PORT [--stub-size BYTES]
+ */
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "wq.h"
+
+#define LOADGEN_MAX_PATHS 64
+#define LOADGEN_MAX_THREADS 64
+#define LOADGEN_HEAD_MAX 8192
+#define LOADGEN_READ_SIZE 65536
+#define LOADGEN_MAX_EVENTS 256
+
+/* One entry of the request mix */
+struct loadgen_request {
+  char *path;
+  char *data;         // The whole request, ready to send
+  size_t len;
+  int weight;
+};
+
+enum { CONN_IDLE, CONN_CONNECTING, CONN_SENDING, CONN_READING };
+
+/* Where the response parser is */
+enum {
+  PARSE_HEAD,
+  PARSE_BODY,         // Content-Length bytes to go
+  PARSE_CHUNK_SIZE,
+  PARSE_CHUNK_DATA,
+  PARSE_CHUNK_END,    // CRLF after a chunk
+  PARSE_TRAILER,
+  PARSE_UNTIL_CLOSE,
+};
+
+struct loadgen_conn {
+  int fd;
+  int state;
+  struct loadgen_request *request;
+  size_t sent;
+  uint64_t start;     // When the request was due (open loop) or started
+
+  int parse;
+  int close;          // The server closes the connection after this response
+  int status;
+  long long remaining;
+  size_t head_len;
+  char head[LOADGEN_HEAD_MAX + 1];
+  size_t line_len;
+  char line[32];
+
+  struct loadgen_conn *next_idle;
+};
+
+struct loadgen_thread {
+  int epoll_fd;
+  struct loadgen_conn *conns;
+  int num_conns;
+  struct loadgen_conn *idle;
+  unsigned int seed;
+  double rate;                // Requests per second, 0 for closed loop
+  uint64_t stop;
+
+  uint64_t completed;
+  uint64_t errors;
+  uint64_t missed;            // Due in the open loop but never sent
+  uint64_t bytes;
+  uint64_t statuses[6];
+  uint64_t max_latency;
+  uint64_t latencies[METRICS_BUCKETS];
+};
+
+char *loadgen_host = "127.0.0.1";
+int loadgen_port = 8000;
+int loadgen_connections = 64;
+int loadgen_threads = 1;
+int loadgen_duration = 10;
+double loadgen_rate = 0;
+int loadgen_keep_alive = 1;
+struct sockaddr_in loadgen_address;
+
+struct loadgen_request loadgen_mix[LOADGEN_MAX_PATHS];
+int loadgen_mix_size;
+int loadgen_total_weight;
+
+int stub_port;
+size_t stub_size = 4096;
+char *stub_response;
+size_t stub_response_len;
+
+static void loadgen_close(struct loadgen_conn *conn) {
+  if (conn->fd != -1) {
+    close(conn->fd);
+    conn->fd = -1;
+  }
+}
+
+static struct loadgen_request *loadgen_pick(struct loadgen_thread *thread) {
+  int i, ticket = rand_r(&thread->seed) % loadgen_total_weight;
+  for (i = 0; i < loadgen_mix_size - 1; i++) {
+    ticket -= loadgen_mix[i].weight;
+    if (ticket < 0)
+      break;
+  }
+  return &loadgen_mix[i];
+}
+
+/* Write as much of the request as the socket takes. -1 on error */
+static int loadgen_send(struct loadgen_conn *conn) {
+  while (conn->sent < conn->request->len) {
+    ssize_t bytes_sent = send(conn->fd, conn->request->data + conn->sent,
+        conn->request->len - conn->sent, MSG_NOSIGNAL);
+    if (bytes_sent < 0)
+      return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    conn->sent += bytes_sent;
+  }
+  conn->state = CONN_READING;
+  conn->parse = PARSE_HEAD;
+  conn->head_len = 0;
+  conn->close = !loadgen_keep_alive;
+  return 0;
+}
+
+/* Send a new request on CONN, due at DUE; connects first if need be */
+static int loadgen_start(struct loadgen_thread *thread, struct loadgen_conn *conn, uint64_t due) {
+  conn->request = loadgen_pick(thread);
+  conn->sent = 0;
+  conn->start = due;
+
+  if (conn->fd != -1) {
+    conn->state = CONN_SENDING;
+    return loadgen_send(conn);
+  }
+
+  conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (conn->fd == -1)
+    return -1;
+  int one = 1;
+  setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  /* Edge triggered: every handler goes on until it would block */
+  struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLET, .data.ptr = conn };
+  if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev) == -1)
+    return -1;
+  if (connect(conn->fd, (struct sockaddr *) &loadgen_address, sizeof(loadgen_address)) == -1 &&
+      errno != EINPROGRESS)
+    return -1;
+  conn->state = CONN_CONNECTING;
+  return 0;
+}
+
+/* Parse a response head once it is complete. -1 if it is malformed */
+static int loadgen_parse_head(struct loadgen_conn *conn) {
+  char *value;
+
+  if (strncmp(conn->head, "HTTP/1.", 7) != 0 || conn->head_len < 12)
+    return -1;
+  conn->status = atoi(conn->head + 9);
+
+  if (strcasestr(conn->head, "\r\nConnection: close") != NULL ||
+      strncmp(conn->head, "HTTP/1.0", 8) == 0)
+    conn->close = 1;
+
+  if (strcasestr(conn->head, "\r\nTransfer-Encoding: chunked") != NULL) {
+    conn->parse = PARSE_CHUNK_SIZE;
+    conn->line_len = 0;
+  } else if ((value = strcasestr(conn->head, "\r\nContent-Length:")) != NULL) {
+    conn->remaining = atoll(value + 17);
+    conn->parse = PARSE_BODY;
+  } else if (conn->status == 204 || conn->status == 304) {
+    conn->remaining = 0;
+    conn->parse = PARSE_BODY;
+  } else {
+    conn->parse = PARSE_UNTIL_CLOSE;
+    conn->close = 1;
+  }
+  return 0;
+}
+
+/* Collect a line for the chunked parser. Returns the bytes used; sets
+ * *DONE once the line is complete */
+static size_t loadgen_line(struct loadgen_conn *conn, char *data, size_t size, int *done) {
+  size_t i;
+  *done = 0;
+  for (i = 0; i < size; i++) {
+    if (data[i] == '\n') {
+      *done = 1;
+      conn->line[conn->line_len] = '\0';
+      return i + 1;
+    }
+    if (conn->line_len < sizeof(conn->line) - 1)
+      conn->line[conn->line_len++] = data[i];
+  }
+  return size;
+}
+
+/* Feed response bytes to the parser: 1 once the response is complete, 0 if
+ * more is needed, -1 if it is malformed */
+static int loadgen_feed(struct loadgen_conn *conn, char *data, size_t size) {
+  size_t used;
+  int done;
+
+  while (size > 0) {
+    switch (conn->parse) {
+    case PARSE_HEAD: {
+      size_t old_len = conn->head_len;
+      used = LOADGEN_HEAD_MAX - old_len < size ? LOADGEN_HEAD_MAX - old_len : size;
+      memcpy(conn->head + old_len, data, used);
+      conn->head_len += used;
+      conn->head[conn->head_len] = '\0';
+
+      char *end = strstr(conn->head + (old_len > 3 ? old_len - 3 : 0), "\r\n\r\n");
+      if (end == NULL) {
+        if (conn->head_len == LOADGEN_HEAD_MAX)
+          return -1;
+        return 0;
+      }
+      used = end + 4 - conn->head - old_len;
+      end[2] = '\0';
+      if (loadgen_parse_head(conn) < 0)
+        return -1;
+      if (conn->parse == PARSE_BODY && conn->remaining == 0)
+        return 1;
+      break;
+    }
+    case PARSE_BODY:
+    case PARSE_CHUNK_DATA:
+    case PARSE_CHUNK_END:
+      used = (size_t) conn->remaining < size ? (size_t) conn->remaining : size;
+      conn->remaining -= used;
+      if (conn->remaining > 0)
+        break;
+      if (conn->parse == PARSE_BODY)
+        return 1;
+      if (conn->parse == PARSE_CHUNK_DATA) {
+        conn->parse = PARSE_CHUNK_END;
+        conn->remaining = 2;
+      } else {
+        conn->parse = PARSE_CHUNK_SIZE;
+        conn->line_len = 0;
+      }
+      break;
+    case PARSE_CHUNK_SIZE:
+      used = loadgen_line(conn, data, size, &done);
+      if (done) {
+        conn->remaining = strtoll(conn->line, NULL, 16);
+        conn->parse = conn->remaining > 0 ? PARSE_CHUNK_DATA : PARSE_TRAILER;
+        conn->line_len = 0;
+      }
+      break;
+    case PARSE_TRAILER:
+      used = loadgen_line(conn, data, size, &done);
+      if (done && (conn->line_len == 0 || (conn->line_len == 1 && conn->line[0] == '\r')))
+        return size == used ? 1 : -1;
+      if (done)
+        conn->line_len = 0;
+      break;
+    default:
+      used = size;
+      break;
+    }
+    data += used;
+    size -= used;
+  }
+  return 0;
+}
+
+/* The response on CONN is complete */
+static void loadgen_complete(struct loadgen_thread *thread, struct loadgen_conn *conn) {
+  uint64_t latency = wq_clock() - conn->start;
+  thread->latencies[metrics_bucket(latency)]++;
+  if (latency > thread->max_latency)
+    thread->max_latency = latency;
+  thread->statuses[conn->status / 100 >= 1 && conn->status / 100 <= 5 ? conn->status / 100 : 0]++;
+  thread->completed++;
+
+  if (conn->close)
+    loadgen_close(conn);
+  conn->state = CONN_IDLE;
+}
+
+/* Read whatever has arrived. -1 on error */
+static int loadgen_read(struct loadgen_thread *thread, struct loadgen_conn *conn) {
+  static __thread char buf[LOADGEN_READ_SIZE];
+
+  while (conn->state == CONN_READING) {
+    ssize_t bytes_read = recv(conn->fd, buf, sizeof(buf), 0);
+    if (bytes_read < 0)
+      return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    if (bytes_read == 0) {
+      if (conn->parse != PARSE_UNTIL_CLOSE)
+        return -1;
+      loadgen_complete(thread, conn);
+      return 0;
+    }
+
+    thread->bytes += bytes_read;
+    int rc = loadgen_feed(conn, buf, bytes_read);
+    if (rc < 0)
+      return -1;
+    if (rc > 0)
+      loadgen_complete(thread, conn);
+  }
+  return 0;
+}
+
+/* Move CONN along after an event. -1 on error */
+static int loadgen_handle(struct loadgen_thread *thread, struct loadgen_conn *conn) {
+  if (conn->state == CONN_CONNECTING) {
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error != 0)
+      return -1;
+    conn->state = CONN_SENDING;
+  }
+  if (conn->state == CONN_SENDING && loadgen_send(conn) < 0)
+    return -1;
+  if (conn->state == CONN_READING)
+    return loadgen_read(thread, conn);
+  return 0;
+}
+
+static void loadgen_fail(struct loadgen_thread *thread, struct loadgen_conn *conn) {
+  thread->errors++;
+  loadgen_close(conn);
+  conn->state = CONN_IDLE;
+}
+
+static void *loadgen_run(void *arg) {
+  struct loadgen_thread *thread = arg;
+  struct epoll_event events[LOADGEN_MAX_EVENTS];
+  uint64_t begin = wq_clock(), now = begin, started = 0;
+  uint64_t interval = thread->rate > 0 ? 1e9 / thread->rate : 0;
+  int i;
+
+  thread->stop = begin + loadgen_duration * 1000000000ULL;
+  for (i = 0; i < thread->num_conns; i++) {
+    struct loadgen_conn *conn = &thread->conns[i];
+    conn->fd = -1;
+    conn->state = CONN_IDLE;
+    conn->next_idle = thread->idle;
+    thread->idle = conn;
+  }
+
+  while (now < thread->stop) {
+    /* Give every idle connection work: all of them in the closed loop,
+     * as many as requests are due in the open loop */
+    while (thread->idle != NULL) {
+      uint64_t due = interval > 0 ? begin + started * interval : wq_clock();
+      if (due > now && interval > 0)
+        break;
+      struct loadgen_conn *conn = thread->idle;
+      thread->idle = conn->next_idle;
+      started++;
+      if (loadgen_start(thread, conn, due) < 0)
+        loadgen_fail(thread, conn);
+      else if (conn->state == CONN_READING && loadgen_read(thread, conn) < 0)
+        loadgen_fail(thread, conn);
+      if (conn->state == CONN_IDLE) {
+        conn->next_idle = thread->idle;
+        thread->idle = conn;
+        if (interval == 0 && conn->fd == -1 && thread->errors > 0)
+          break;      // Don't spin on a server that refuses us
+      }
+    }
+
+    int timeout = (thread->stop - now) / 1000000 + 1;
+    if (interval > 0 && thread->idle != NULL) {
+      uint64_t due = begin + started * interval;
+      timeout = due > now ? (due - now) / 1000000 : 0;
+    } else if (interval == 0 && thread->idle != NULL) {
+      timeout = 1;
+    }
+
+    int nfds = epoll_wait(thread->epoll_fd, events, LOADGEN_MAX_EVENTS, timeout);
+    if (nfds == -1 && errno != EINTR) {
+      perror("epoll_wait");
+      break;
+    }
+    for (i = 0; i < nfds; i++) {
+      struct loadgen_conn *conn = events[i].data.ptr;
+      if (conn->state == CONN_IDLE)
+        continue;
+      if (loadgen_handle(thread, conn) < 0)
+        loadgen_fail(thread, conn);
+      if (conn->state == CONN_IDLE) {
+        conn->next_idle = thread->idle;
+        thread->idle = conn;
+      }
+    }
+    now = wq_clock();
+  }
+
+  if (interval > 0) {
+    uint64_t due = (thread->stop - begin) / interval;
+    thread->missed = due > started ? due - started : 0;
+  }
+  for (i = 0; i < thread->num_conns; i++)
+    loadgen_close(&thread->conns[i]);
+  return NULL;
+}
+
+/* Parse "path[:weight],..." into loadgen_mix */
+static int loadgen_parse_mix(char *mix) {
+  char *entry, *save = NULL;
+
+  loadgen_mix_size = 0;
+  loadgen_total_weight = 0;
+  for (entry = strtok_r(mix, ",", &save); entry != NULL; entry = strtok_r(NULL, ",", &save)) {
+    struct loadgen_request *request = &loadgen_mix[loadgen_mix_size];
+    char *colon = strrchr(entry, ':');
+    if (loadgen_mix_size == LOADGEN_MAX_PATHS)
+      return -1;
+
+    request->weight = 1;
+    request->path = entry;
+    if (colon != NULL) {
+      *colon = '\0';
+      request->weight = atoi(colon + 1);
+    }
+    if (request->weight <= 0 || request->path[0] != '/')
+      return -1;
+
+    request->len = asprintf(&request->data, "GET %s HTTP/1.1\r\nHost: %s:%d\r\n%s\r\n",
+        request->path, loadgen_host, loadgen_port,
+        loadgen_keep_alive ? "" : "Connection: close\r\n");
+    loadgen_total_weight += request->weight;
+    loadgen_mix_size++;
+  }
+  return loadgen_mix_size > 0 ? 0 : -1;
+}
+
+static void loadgen_report(struct loadgen_thread *threads) {
+  struct loadgen_thread total;
+  int i, j;
+
+  memset(&total, 0, sizeof(total));
+  for (i = 0; i < loadgen_threads; i++) {
+    total.completed += threads[i].completed;
+    total.errors += threads[i].errors;
+    total.missed += threads[i].missed;
+    total.bytes += threads[i].bytes;
+    for (j = 0; j < 6; j++)
+      total.statuses[j] += threads[i].statuses[j];
+    for (j = 0; j < METRICS_BUCKETS; j++)
+      total.latencies[j] += threads[i].latencies[j];
+    if (threads[i].max_latency > total.max_latency)
+      total.max_latency = threads[i].max_latency;
+  }
+
+  printf("%d connections on %d thread(s), %s loop", loadgen_connections, loadgen_threads,
+      loadgen_rate > 0 ? "open" : "closed");
+  if (loadgen_rate > 0)
+    printf(" at %.0f req/s", loadgen_rate);
+  printf(", keep-alive %s, %d s\n", loadgen_keep_alive ? "on" : "off", loadgen_duration);
+  for (i = 0; i < loadgen_mix_size; i++)
+    printf("  %3d x %s\n", loadgen_mix[i].weight, loadgen_mix[i].path);
+
+  printf("%12s %12s %12s %12s\n", "requests", "errors", "req/s", "MB/s");
+  printf("%12llu %12llu %12.0f %12.2f\n", (unsigned long long) total.completed,
+      (unsigned long long) total.errors, total.completed / (double) loadgen_duration,
+      total.bytes / (double) loadgen_duration / 1e6);
+  if (total.missed > 0)
+    printf("%llu requests fell due but were never sent: the server didn't keep up\n",
+        (unsigned long long) total.missed);
+
+  printf("%12s %12s %12s %12s %12s\n", "p50 (ms)", "p90", "p99", "p99.9", "max");
+  if (total.completed > 0) {
+    printf("%12.3f %12.3f %12.3f %12.3f %12.3f\n",
+        metrics_quantile(total.latencies, 0.5) / 1e6, metrics_quantile(total.latencies, 0.9) / 1e6,
+        metrics_quantile(total.latencies, 0.99) / 1e6,
+        metrics_quantile(total.latencies, 0.999) / 1e6, total.max_latency / 1e6);
+  }
+  printf("status: 1xx %llu, 2xx %llu, 3xx %llu, 4xx %llu, 5xx %llu\n",
+      (unsigned long long) total.statuses[1], (unsigned long long) total.statuses[2],
+      (unsigned long long) total.statuses[3], (unsigned long long) total.statuses[4],
+      (unsigned long long) total.statuses[5]);
+}
+
+/* Serve one upstream connection: answer every request with the stub body */
+static void *stub_serve(void *arg) {
+  int fd = (int) (long) arg;
+  char buf[LOADGEN_HEAD_MAX + 1];
+  size_t len = 0;
+
+  while (1) {
+    ssize_t bytes_read = recv(fd, buf + len, LOADGEN_HEAD_MAX - len, 0);
+    if (bytes_read <= 0)
+      break;
+    len += bytes_read;
+    buf[len] = '\0';
+
+    char *head = buf, *end;
+    int close_after = 0;
+    while (!close_after && (end = strstr(head, "\r\n\r\n")) != NULL) {
+      *end = '\0';
+      close_after = strcasestr(head, "\r\nConnection: close") != NULL;
+      if (send(fd, stub_response, stub_response_len, MSG_NOSIGNAL) < 0)
+        close_after = 1;
+      head = end + 4;
+    }
+    if (close_after || (head == buf && len == LOADGEN_HEAD_MAX))
+      break;
+    len -= head - buf;
+    memmove(buf, head, len);
+  }
+  close(fd);
+  return NULL;
+}
+
+/* A stand-in proxy target: a thread per connection, fixed response */
+static void stub_run(void) {
+  struct sockaddr_in address;
+  int one = 1;
+
+  stub_response_len = asprintf(&stub_response,
+      "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: %zu\r\n\r\n",
+      stub_size);
+  stub_response = realloc(stub_response, stub_response_len + stub_size);
+  memset(stub_response + stub_response_len, 'x', stub_size);
+  stub_response_len += stub_size;
+
+  int server_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = INADDR_ANY;
+  address.sin_port = htons(stub_port);
+  if (server_fd == -1 ||
+      setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1 ||
+      bind(server_fd, (struct sockaddr *) &address, sizeof(address)) == -1 ||
+      listen(server_fd, 1024) == -1) {
+    perror("Failed to listen for the stub upstream");
+    exit(1);
+  }
+  printf("Stub upstream on port %d, %zu byte responses\n", stub_port, stub_size);
+
+  while (1) {
+    int fd = accept(server_fd, NULL, NULL);
+    if (fd == -1)
+      continue;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, stub_serve, (void *) (long) fd) != 0) {
+      close(fd);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+}
+
+static void exit_with_usage(char *name) {
+  fprintf(stderr,
+      "Usage: %s [--host 127.0.0.1] [--port 8000] [--connections 64] [--threads 1]\n"
+      "          [--duration 10] [--rate REQ_PER_S] [--mix /index.html:8,/dir/:1]\n"
+      "          [--no-keep-alive]\n"
+      "       %s --stub PORT [--stub-size BYTES]\n", name, name);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  struct loadgen_thread threads[LOADGEN_MAX_THREADS];
+  pthread_t thread_ids[LOADGEN_MAX_THREADS];
+  char *mix = "/";
+  int i;
+
+  for (i = 1; i < argc; i++) {
+    char *value = i + 1 < argc ? argv[i + 1] : NULL;
+    if (strcmp("--no-keep-alive", argv[i]) == 0) {
+      loadgen_keep_alive = 0;
+      continue;
+    }
+    if (value == NULL)
+      exit_with_usage(argv[0]);
+    i++;
+    if (strcmp("--host", argv[i - 1]) == 0)
+      loadgen_host = value;
+    else if (strcmp("--port", argv[i - 1]) == 0)
+      loadgen_port = atoi(value);
+    else if (strcmp("--connections", argv[i - 1]) == 0)
+      loadgen_connections = atoi(value);
+    else if (strcmp("--threads", argv[i - 1]) == 0)
+      loadgen_threads = atoi(value);
+    else if (strcmp("--duration", argv[i - 1]) == 0)
+      loadgen_duration = atoi(value);
+    else if (strcmp("--rate", argv[i - 1]) == 0)
+      loadgen_rate = atof(value);
+    else if (strcmp("--mix", argv[i - 1]) == 0)
+      mix = value;
+    else if (strcmp("--stub", argv[i - 1]) == 0)
+      stub_port = atoi(value);
+    else if (strcmp("--stub-size", argv[i - 1]) == 0)
+      stub_size = atol(value);
+    else
+      exit_with_usage(argv[0]);
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  if (stub_port > 0)
+    stub_run();
+
+  if (loadgen_port <= 0 || loadgen_connections <= 0 || loadgen_threads <= 0 ||
+      loadgen_threads > LOADGEN_MAX_THREADS || loadgen_duration <= 0 || loadgen_rate < 0 ||
+      loadgen_parse_mix(strdup(mix)) < 0)
+    exit_with_usage(argv[0]);
+  if (loadgen_threads > loadgen_connections)
+    loadgen_threads = loadgen_connections;
+
+  memset(&loadgen_address, 0, sizeof(loadgen_address));
+  loadgen_address.sin_family = AF_INET;
+  loadgen_address.sin_port = htons(loadgen_port);
+  if (inet_pton(AF_INET, loadgen_host, &loadgen_address.sin_addr) != 1) {
+    fprintf(stderr, "Expected an IPv4 address after --host\n");
+    return 1;
+  }
+
+  memset(threads, 0, sizeof(threads));
+  for (i = 0; i < loadgen_threads; i++) {
+    struct loadgen_thread *thread = &threads[i];
+    thread->num_conns = loadgen_connections / loadgen_threads +
+      (i < loadgen_connections % loadgen_threads);
+    thread->conns = calloc(thread->num_conns, sizeof(struct loadgen_conn));
+    thread->rate = loadgen_rate * thread->num_conns / loadgen_connections;
+    thread->seed = i + 1;
+    if (thread->conns == NULL || (thread->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+      perror("Failed to set up load thread");
+      return 1;
+    }
+    pthread_create(&thread_ids[i], NULL, loadgen_run, thread);
+  }
+  for (i = 0; i < loadgen_threads; i++)
+    pthread_join(thread_ids[i], NULL);
+
+  loadgen_report(threads);
+  return 0;
+}
@@ -0,0 +1,258 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "metrics.h"
+#include "wq.h"
+
+int metrics_enabled = 1;
+
+/* One thread's share of every metric */
+struct metrics_block {
+  uint64_t responses[6];      // By status class, 1xx to 5xx
+  uint64_t rejected[METRICS_NUM_REJECTIONS];
+  uint64_t counts[METRICS_NUM_HISTOGRAMS][METRICS_BUCKETS];
+  uint64_t sums[METRICS_NUM_HISTOGRAMS];
+  uint64_t begun;             // Start of the current request, or its last mark
+  int owned;                  // A live thread records here
+  struct metrics_block *next;
+};
+
+/* How each histogram is exported. Prometheus buckets end at the powers of
+ * two from 2^first_bit to 2^last_bit, which are also HDR bucket edges, so a
+ * bucket holds exactly the values below its bound. */
+static const struct {
+  char *name;
+  char *unit;
+  char *help;
+  double scale;               // To the exported unit
+  int first_bit;
+  int last_bit;
+} metrics_histograms[METRICS_NUM_HISTOGRAMS] = {
+  { "httpserver_queue_wait", "seconds", "Time connections waited for a worker thread.",
+    1e-9, 10, 36 },
+  { "httpserver_parse", "seconds", "Time from picking up a connection until its request was parsed.",
+    1e-9, 10, 36 },
+  { "httpserver_handler", "seconds", "Time from the parsed request until the response was sent.",
+    1e-9, 10, 36 },
+  { "httpserver_response", "bytes", "Bytes sent per response, head included.",
+    1, 6, 32 },
+};
+
+static const char *metrics_rejections[METRICS_NUM_REJECTIONS] = {
+  "queue_full", "queue_timeout"
+};
+
+static const double metrics_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+static struct metrics_block *metrics_blocks;   // Every block ever made
+static __thread struct metrics_block *metrics_self;
+static pthread_key_t metrics_key;
+static pthread_once_t metrics_once = PTHREAD_ONCE_INIT;
+
+/* Only the owning thread writes a block, so a plain store is enough; it is
+ * atomic only so that a scrape never reads a torn value */
+static inline void metrics_add(uint64_t *counter, uint64_t value) {
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value,
+      __ATOMIC_RELAXED);
+}
+
+/* Hand a block back when its thread exits */
+static void metrics_release(void *block) {
+  __atomic_store_n(&((struct metrics_block *) block)->owned, 0, __ATOMIC_RELEASE);
+}
+
+static void metrics_init(void) {
+  pthread_key_create(&metrics_key, metrics_release);
+}
+
+/* The calling thread's block: one left by an exited thread, or a new one */
+static struct metrics_block *metrics_block(void) {
+  struct metrics_block *block;
+
+  if (metrics_self != NULL)
+    return metrics_self;
+  pthread_once(&metrics_once, metrics_init);
+
+  for (block = __atomic_load_n(&metrics_blocks, __ATOMIC_ACQUIRE); block != NULL;
+      block = block->next) {
+    int owned = 0;
+    if (__atomic_compare_exchange_n(&block->owned, &owned, 1, 0,
+          __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      break;
+  }
+
+  if (block == NULL) {
+    if (posix_memalign((void **) &block, WQ_CACHE_LINE, sizeof(struct metrics_block)) != 0)
+      return NULL;
+    memset(block, 0, sizeof(struct metrics_block));
+    block->owned = 1;
+    block->next = __atomic_load_n(&metrics_blocks, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&metrics_blocks, &block->next, block, 1,
+          __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+  }
+
+  pthread_setspecific(metrics_key, block);
+  metrics_self = block;
+  return block;
+}
+
+/* Exact below METRICS_SUB_BUCKETS, then METRICS_SUB_BUCKETS linear buckets
+ * per power of two */
+int metrics_bucket(uint64_t value) {
+  if (value < METRICS_SUB_BUCKETS)
+    return value;
+
+  int bits = 64 - __builtin_clzll(value);
+  if (bits > METRICS_MAX_BITS)
+    return METRICS_BUCKETS - 1;
+  int shift = bits - 1 - METRICS_SUB_BITS;
+  return (shift + 1) * METRICS_SUB_BUCKETS + (value >> shift) - METRICS_SUB_BUCKETS;
+}
+
+/* Smallest value in bucket INDEX, and how many values it covers */
+static uint64_t metrics_bucket_start(int index, uint64_t *width) {
+  if (index < METRICS_SUB_BUCKETS) {
+    *width = 1;
+    return index;
+  }
+  int shift = index / METRICS_SUB_BUCKETS - 1;
+  *width = (uint64_t) 1 << shift;
+  return (uint64_t) (index % METRICS_SUB_BUCKETS + METRICS_SUB_BUCKETS) << shift;
+}
+
+void metrics_record(int histogram, uint64_t value) {
+  struct metrics_block *block;
+  if (!metrics_enabled || (block = metrics_block()) == NULL)
+    return;
+  metrics_add(&block->counts[histogram][metrics_bucket(value)], 1);
+  metrics_add(&block->sums[histogram], value);
+}
+
+void metrics_request_begin(void) {
+  struct metrics_block *block;
+  if (metrics_enabled && (block = metrics_block()) != NULL)
+    block->begun = wq_clock();
+}
+
+void metrics_mark(int histogram) {
+  struct metrics_block *block;
+  if (!metrics_enabled || (block = metrics_block()) == NULL)
+    return;
+  uint64_t now = wq_clock();
+  metrics_record(histogram, now - block->begun);
+  block->begun = now;
+}
+
+void metrics_request_end(int status_code, size_t bytes) {
+  struct metrics_block *block;
+  if (!metrics_enabled || status_code == 0 || (block = metrics_block()) == NULL)
+    return;
+  metrics_mark(METRICS_HANDLER);
+  metrics_add(&block->responses[status_code / 100 <= 5 ? status_code / 100 : 5], 1);
+  metrics_record(METRICS_BYTES, bytes);
+}
+
+void metrics_reject(int reason) {
+  struct metrics_block *block;
+  if (metrics_enabled && (block = metrics_block()) != NULL)
+    metrics_add(&block->rejected[reason], 1);
+}
+
+uint64_t metrics_quantile(uint64_t *counts, double quantile) {
+  uint64_t count = 0, seen = 0, rank, width, start;
+  int i;
+
+  for (i = 0; i < METRICS_BUCKETS; i++)
+    count += counts[i];
+  rank = quantile * count;
+  if (rank < quantile * count || rank == 0)
+    rank++;
+  for (i = 0; i < METRICS_BUCKETS - 1; i++) {
+    seen += counts[i];
+    if (seen >= rank)
+      break;
+  }
+  start = metrics_bucket_start(i, &width);
+  return start + (width - 1) / 2;
+}
+
+static void metrics_render_histogram(FILE *out, int histogram, uint64_t *counts, uint64_t sum) {
+  char *name = metrics_histograms[histogram].name;
+  char *unit = metrics_histograms[histogram].unit;
+  double scale = metrics_histograms[histogram].scale;
+  uint64_t count = 0, below = 0;
+  int i, bit, index = 0;
+  size_t q;
+
+  for (i = 0; i < METRICS_BUCKETS; i++)
+    count += counts[i];
+
+  fprintf(out, "# HELP %s_%s %s\n# TYPE %s_%s histogram\n", name, unit,
+      metrics_histograms[histogram].help, name, unit);
+  for (bit = metrics_histograms[histogram].first_bit;
+      bit <= metrics_histograms[histogram].last_bit; bit++) {
+    for (; index < metrics_bucket((uint64_t) 1 << bit); index++)
+      below += counts[index];
+    fprintf(out, "%s_%s_bucket{le=\"%.9g\"} %llu\n", name, unit,
+        ((uint64_t) 1 << bit) * scale, (unsigned long long) below);
+  }
+  fprintf(out, "%s_%s_bucket{le=\"+Inf\"} %llu\n", name, unit, (unsigned long long) count);
+  fprintf(out, "%s_%s_sum %.9g\n", name, unit, sum * scale);
+  fprintf(out, "%s_%s_count %llu\n", name, unit, (unsigned long long) count);
+
+  /* The same data at full resolution, as quantiles */
+  fprintf(out, "# HELP %s_quantile_%s %s\n# TYPE %s_quantile_%s summary\n", name, unit,
+      metrics_histograms[histogram].help, name, unit);
+  for (q = 0; q < sizeof(metrics_quantiles) / sizeof(metrics_quantiles[0]); q++) {
+    fprintf(out, "%s_quantile_%s{quantile=\"%g\"} ", name, unit, metrics_quantiles[q]);
+    if (count == 0)
+      fprintf(out, "NaN\n");
+    else
+      fprintf(out, "%.9g\n", metrics_quantile(counts, metrics_quantiles[q]) * scale);
+  }
+  fprintf(out, "%s_quantile_%s_sum %.9g\n", name, unit, sum * scale);
+  fprintf(out, "%s_quantile_%s_count %llu\n", name, unit, (unsigned long long) count);
+}
+
+void metrics_render(FILE *out) {
+  uint64_t responses[6] = { 0 };
+  uint64_t rejected[METRICS_NUM_REJECTIONS] = { 0 };
+  uint64_t sums[METRICS_NUM_HISTOGRAMS] = { 0 };
+  uint64_t (*counts)[METRICS_BUCKETS];
+  struct metrics_block *block;
+  int i, j;
+
+  if ((counts = calloc(METRICS_NUM_HISTOGRAMS, sizeof(*counts))) == NULL)
+    return;
+
+  for (block = __atomic_load_n(&metrics_blocks, __ATOMIC_ACQUIRE); block != NULL;
+      block = block->next) {
+    for (i = 1; i <= 5; i++)
+      responses[i] += __atomic_load_n(&block->responses[i], __ATOMIC_RELAXED);
+    for (i = 0; i < METRICS_NUM_REJECTIONS; i++)
+      rejected[i] += __atomic_load_n(&block->rejected[i], __ATOMIC_RELAXED);
+    for (i = 0; i < METRICS_NUM_HISTOGRAMS; i++) {
+      sums[i] += __atomic_load_n(&block->sums[i], __ATOMIC_RELAXED);
+      for (j = 0; j < METRICS_BUCKETS; j++)
+        counts[i][j] += __atomic_load_n(&block->counts[i][j], __ATOMIC_RELAXED);
+    }
+  }
+
+  fprintf(out, "# HELP httpserver_responses_total Responses sent, by status class.\n"
+      "# TYPE httpserver_responses_total counter\n");
+  for (i = 1; i <= 5; i++)
+    fprintf(out, "httpserver_responses_total{code=\"%dxx\"} %llu\n", i,
+        (unsigned long long) responses[i]);
+
+  fprintf(out, "# HELP httpserver_rejected_total Connections turned away unserved "
+      "while overloaded, by reason.\n# TYPE httpserver_rejected_total counter\n");
+  for (i = 0; i < METRICS_NUM_REJECTIONS; i++)
+    fprintf(out, "httpserver_rejected_total{reason=\"%s\"} %llu\n", metrics_rejections[i],
+        (unsigned long long) rejected[i]);
+
+  for (i = 0; i < METRICS_NUM_HISTOGRAMS; i++)
+    metrics_render_histogram(out, i, counts[i], sums[i]);
+  free(counts);
+}
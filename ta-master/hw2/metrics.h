@@ -0,0 +1,74 @@
+#ifndef __METRICS__
+#define __METRICS__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* METRICS counts responses and records where requests spend their time, in
+ * HDR-style histograms: every power of two is split into
+ * METRICS_SUB_BUCKETS linear buckets, so any value is kept to within a few
+ * percent from nanoseconds up to hours without configuring bucket bounds.
+ *
+ * Every thread records into a block of its own, with plain relaxed stores,
+ * so recording takes no lock and shares no cache line. A scrape sums the
+ * blocks of all threads; blocks of threads that exit are handed to the next
+ * new thread, keeping their counts. */
+
+/* log2 of the buckets each power of two is split into */
+#define METRICS_SUB_BITS 4
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BITS)
+
+/* Values from 0 up to 2^METRICS_MAX_BITS - 1; larger ones land in the last
+ * bucket */
+#define METRICS_MAX_BITS 48
+#define METRICS_BUCKETS ((METRICS_MAX_BITS - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS)
+
+enum metrics_histogram {
+  METRICS_QUEUE,        // Nanoseconds a connection waited for a worker
+  METRICS_PARSE,        // Nanoseconds until the request head was parsed
+  METRICS_HANDLER,      // Nanoseconds from the parsed request to the response
+  METRICS_BYTES,        // Bytes sent per response
+  METRICS_NUM_HISTOGRAMS
+};
+
+/* Why a connection was turned away unserved */
+enum metrics_rejection {
+  METRICS_QUEUE_FULL,     // The work queue was at its high-water mark
+  METRICS_QUEUE_TIMEOUT,  // It waited too long for a worker
+  METRICS_NUM_REJECTIONS
+};
+
+/* Whether anything is recorded; set before the server starts */
+extern int metrics_enabled;
+
+/* Adds VALUE to one of the calling thread's histograms. */
+void metrics_record(int histogram, uint64_t value);
+
+/* Marks the start of a request on the calling thread. */
+void metrics_request_begin(void);
+
+/* Records the time since metrics_request_begin, or since the last mark, in
+ * HISTOGRAM. */
+void metrics_mark(int histogram);
+
+/* Ends the request begun on this thread: its response had STATUS_CODE (0 if
+ * none was sent) and BYTES bytes. The time since the last mark is recorded
+ * as METRICS_HANDLER. */
+void metrics_request_end(int status_code, size_t bytes);
+
+/* Counts a connection turned away for REASON. */
+void metrics_reject(int reason);
+
+/* Bucket of VALUE, for histograms kept elsewhere as arrays of
+ * METRICS_BUCKETS counts (like the load generator's). */
+int metrics_bucket(uint64_t value);
+
+/* Value below which a fraction QUANTILE (0 to 1) of the values counted in
+ * COUNTS lie, to within the bucket's resolution. */
+uint64_t metrics_quantile(uint64_t *counts, double quantile);
+
+/* Writes every metric to OUT in the Prometheus text format. */
+void metrics_render(FILE *out);
+
+#endif
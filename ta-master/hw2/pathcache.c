@@ -0,0 +1,426 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "libhttp.h"
+#include "pathcache.h"
+#include "utlist.h"
+
+#define PATHCACHE_SHARDS 16
+#define PATHCACHE_BUCKETS 256
+
+/* Buckets of the table of watched directories */
+#define PATHCACHE_WATCH_BUCKETS 256
+
+/* Bytes of inotify events read at a time */
+#define PATHCACHE_EVENT_BUFFER 65536
+
+/* Changes to a watched directory that may change what paths resolve to */
+#define PATHCACHE_EVENTS (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | \
+    IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+typedef struct pathcache_shard {
+  pthread_mutex_t lock;
+  pathcache_entry_t *lru;
+  pathcache_entry_t *buckets[PATHCACHE_BUCKETS];
+  size_t used;
+} pathcache_shard_t;
+
+/* A directory we added a watch for, so later misses there skip the syscall */
+typedef struct pathcache_watch {
+  int wd;
+  struct pathcache_watch *chain;
+  char dir[];
+} pathcache_watch_t;
+
+static pathcache_shard_t *pathcache_shards;
+static size_t pathcache_shard_capacity;
+static int pathcache_enabled;
+static char *pathcache_root;
+static int pathcache_inotify_fd = -1;
+
+static pthread_mutex_t pathcache_watches_lock = PTHREAD_MUTEX_INITIALIZER;
+static pathcache_watch_t *pathcache_watches[PATHCACHE_WATCH_BUCKETS];
+
+/* Bumped by the watcher before it drops entries, so that a path resolved
+ * while a change went by is not cached */
+static unsigned long pathcache_generation;
+
+/* FNV-1a */
+static unsigned int pathcache_hash(char *key) {
+  unsigned int hash = 2166136261u;
+  while (*key) {
+    hash ^= (unsigned char) *key++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static pathcache_shard_t *pathcache_shard(unsigned int hash) {
+  return &pathcache_shards[hash % PATHCACHE_SHARDS];
+}
+
+static pathcache_entry_t **pathcache_bucket(pathcache_shard_t *shard, unsigned int hash) {
+  return &shard->buckets[(hash / PATHCACHE_SHARDS) % PATHCACHE_BUCKETS];
+}
+
+static void pathcache_close(pathcache_entry_t *entry) {
+  if (entry->file_fd != -1)
+    close(entry->file_fd);
+  if (entry->gz_fd != -1)
+    close(entry->gz_fd);
+}
+
+/* Remove ENTRY from its shard's table and LRU list. Called with the lock held. */
+static void pathcache_unlink(pathcache_shard_t *shard, pathcache_entry_t *entry) {
+  pathcache_entry_t **link = pathcache_bucket(shard, entry->hash);
+  while (*link != entry)
+    link = &(*link)->chain;
+  *link = entry->chain;
+
+  DL_DELETE(shard->lru, entry);
+  shard->used--;
+  entry->unlinked = 1;
+  if (entry->refs == 0) {
+    pathcache_close(entry);
+    free(entry);
+  }
+}
+
+/* Drop the entries of the directory watched by WD that depend on its entry
+ * NAME (any entry of it if NULL); a WD of -1 drops everything */
+static void pathcache_drop(int wd, char *name) {
+  pathcache_entry_t *entry, *tmp;
+  int i;
+
+  for (i = 0; i < PATHCACHE_SHARDS; i++) {
+    pathcache_shard_t *shard = &pathcache_shards[i];
+    pthread_mutex_lock(&shard->lock);
+    DL_FOREACH_SAFE(shard->lru, entry, tmp) {
+      if (wd != -1 && entry->wd != wd)
+        continue;
+      /* Listings depend on every name in their directory, files on their
+       * own and their .gz sibling's */
+      if (wd != -1 && name != NULL && entry->base != NULL) {
+        size_t base_len = strlen(entry->base);
+        if (strncmp(name, entry->base, base_len) != 0 ||
+            (name[base_len] != '\0' && strcmp(name + base_len, ".gz") != 0))
+          continue;
+      }
+      pathcache_unlink(shard, entry);
+    }
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
+
+/* Forget which directories are watched. Their watches stay, and adding
+ * them again only returns the same descriptors. */
+static void pathcache_forget_watches(void) {
+  pathcache_watch_t *watch, *tmp;
+  int i;
+
+  pthread_mutex_lock(&pathcache_watches_lock);
+  for (i = 0; i < PATHCACHE_WATCH_BUCKETS; i++) {
+    for (watch = pathcache_watches[i]; watch != NULL; watch = tmp) {
+      tmp = watch->chain;
+      free(watch);
+    }
+    pathcache_watches[i] = NULL;
+  }
+  pthread_mutex_unlock(&pathcache_watches_lock);
+}
+
+static void pathcache_invalidate(struct inotify_event *event) {
+  /* A directory renamed or removed changes every path below it, and we may
+   * not watch those; start over. Lookups that saw the old watches must not
+   * cache what they find, so the generation moves again. */
+  if ((event->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) ||
+      ((event->mask & IN_ISDIR) && !(event->mask & IN_CREATE))) {
+    pathcache_forget_watches();
+    __atomic_add_fetch(&pathcache_generation, 1, __ATOMIC_ACQ_REL);
+    pathcache_drop(-1, NULL);
+  } else
+    pathcache_drop(event->wd, event->len > 0 ? event->name : NULL);
+}
+
+/* Drop entries as the files they were resolved from change */
+static void *pathcache_watch_loop(void *arg) {
+  char events[PATHCACHE_EVENT_BUFFER]
+    __attribute__((aligned(__alignof__(struct inotify_event))));
+
+  while (1) {
+    ssize_t len = read(pathcache_inotify_fd, events, sizeof(events));
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len <= 0) {
+      perror("Error watching served files; no longer caching paths");
+      __atomic_store_n(&pathcache_enabled, 0, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&pathcache_generation, 1, __ATOMIC_ACQ_REL);
+      pathcache_drop(-1, NULL);
+      break;
+    }
+
+    __atomic_add_fetch(&pathcache_generation, 1, __ATOMIC_ACQ_REL);
+    struct inotify_event *event, *last = NULL;
+    ssize_t offset;
+    for (offset = 0; offset < len; offset += sizeof(struct inotify_event) + event->len) {
+      event = (struct inotify_event *) (events + offset);
+      /* A file being written reports the same change over and over */
+      if (last != NULL && last->wd == event->wd && last->mask == event->mask &&
+          last->len == event->len && (event->len == 0 || strcmp(last->name, event->name) == 0))
+        continue;
+      pathcache_invalidate(event);
+      last = event;
+    }
+  }
+  return NULL;
+}
+
+/* Returns the watch of the directory DIR, adding one if we have none */
+static int pathcache_watch_dir(char *dir) {
+  pathcache_watch_t **bucket = &pathcache_watches[pathcache_hash(dir) % PATHCACHE_WATCH_BUCKETS];
+  pathcache_watch_t *watch;
+  int wd = -1;
+
+  pthread_mutex_lock(&pathcache_watches_lock);
+  for (watch = *bucket; watch != NULL; watch = watch->chain) {
+    if (strcmp(watch->dir, dir) == 0) {
+      wd = watch->wd;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&pathcache_watches_lock);
+  if (wd != -1)
+    return wd;
+
+  if ((wd = inotify_add_watch(pathcache_inotify_fd, dir, PATHCACHE_EVENTS)) == -1)
+    return -1;
+  /* Not remembering it only costs the syscall again next time */
+  size_t dir_len = strlen(dir);
+  if ((watch = malloc(sizeof(pathcache_watch_t) + dir_len + 1)) == NULL)
+    return wd;
+  watch->wd = wd;
+  memcpy(watch->dir, dir, dir_len + 1);
+  pthread_mutex_lock(&pathcache_watches_lock);
+  watch->chain = *bucket;
+  *bucket = watch;
+  pthread_mutex_unlock(&pathcache_watches_lock);
+  return wd;
+}
+
+/* Watch the directory PATH is in and every directory above it up to the
+ * root, before anything there is looked at. Returns the watch of the
+ * innermost one, or -1. */
+static int pathcache_watch(char *path) {
+  static int warned;
+  size_t root_len = strlen(pathcache_root), path_len = strlen(path), i;
+  char *dir = http_scratch_alloc(root_len + path_len + 1);
+  int wd;
+
+  if (dir == NULL)
+    return -1;
+  memcpy(dir, pathcache_root, root_len + 1);
+  wd = pathcache_watch_dir(dir);
+  for (i = 0; i < path_len && wd != -1; i++) {
+    dir[root_len + i] = path[i];
+    if (path[i] == '/' && i > 0) {
+      dir[root_len + i + 1] = '\0';
+      wd = pathcache_watch_dir(dir);
+    }
+  }
+
+  if (wd == -1 && errno == ENOSPC && !__atomic_exchange_n(&warned, 1, __ATOMIC_RELAXED))
+    fprintf(stderr, "Out of inotify watches; paths in more directories won't be cached\n");
+  return wd;
+}
+
+/* Resolve PATH from scratch. Unless WD is -1, the entry is allocated to be
+ * cached in the directory watched by WD. */
+static pathcache_entry_t *pathcache_resolve(char *path, int wd) {
+  struct stat file_stat, gz_stat;
+  char *file_name = resolve_path(pathcache_root, path, &file_stat);
+  char *gz_name = NULL;
+  int file_fd = -1, gz_fd = -1;
+
+  if (file_name == NULL)
+    return NULL;
+
+  if (S_ISREG(file_stat.st_mode)) {
+    /* Describe the descriptor we will actually send */
+    if ((file_fd = open(file_name, O_RDONLY | O_CLOEXEC)) == -1 ||
+        fstat(file_fd, &file_stat) == -1) {
+      fprintf(stderr, "Error in opening file %s : %s\n", file_name, strerror(errno));
+      if (file_fd != -1)
+        close(file_fd);
+      return NULL;
+    }
+
+    /* Prefer a precompressed sibling, if it is at least as new as the file */
+    if ((gz_name = http_scratch_alloc(strlen(file_name) + sizeof(".gz"))) != NULL) {
+      sprintf(gz_name, "%s.gz", file_name);
+      if ((gz_fd = open(gz_name, O_RDONLY | O_CLOEXEC)) != -1 &&
+          (fstat(gz_fd, &gz_stat) == -1 || !S_ISREG(gz_stat.st_mode) ||
+           gz_stat.st_mtime < file_stat.st_mtime)) {
+        close(gz_fd);
+        gz_fd = -1;
+      }
+      if (gz_fd == -1)
+        gz_name = NULL;
+    }
+  }
+
+  /* One allocation for the entry and its strings */
+  size_t key_len = strlen(path), file_name_len = strlen(file_name);
+  size_t gz_name_len = gz_name != NULL ? strlen(gz_name) : 0;
+  size_t size = sizeof(pathcache_entry_t) + key_len + 1 + file_name_len + 1 + gz_name_len + 1;
+  pathcache_entry_t *entry = wd == -1 ? http_scratch_alloc(size) : malloc(size);
+  if (entry == NULL) {
+    if (file_fd != -1)
+      close(file_fd);
+    if (gz_fd != -1)
+      close(gz_fd);
+    return NULL;
+  }
+  entry->key = (char *) (entry + 1);
+  entry->file_name = entry->key + key_len + 1;
+  memcpy(entry->key, path, key_len + 1);
+  memcpy(entry->file_name, file_name, file_name_len + 1);
+  entry->file_fd = file_fd;
+  entry->file_stat = file_stat;
+  entry->mime_type = file_fd != -1 ? http_get_mime_type(file_name) : "text/html";
+  entry->gz_name = NULL;
+  entry->gz_fd = gz_fd;
+  if (gz_name != NULL) {
+    entry->gz_name = entry->file_name + file_name_len + 1;
+    memcpy(entry->gz_name, gz_name, gz_name_len + 1);
+    entry->gz_stat = gz_stat;
+  }
+
+  entry->wd = wd;
+  entry->base = file_fd != -1 ? strrchr(entry->file_name, '/') + 1 : NULL;
+  entry->temporary = wd == -1;
+  entry->refs = 1;
+  entry->unlinked = 0;
+  return entry;
+}
+
+/* Make a new entry visible, unless something changed since GENERATION */
+static pathcache_entry_t *pathcache_add(pathcache_entry_t *entry, unsigned long generation) {
+  pathcache_shard_t *shard = pathcache_shard(entry->hash);
+  pathcache_entry_t **bucket = pathcache_bucket(shard, entry->hash);
+  pathcache_entry_t *old;
+
+  pthread_mutex_lock(&shard->lock);
+  if (__atomic_load_n(&pathcache_generation, __ATOMIC_ACQUIRE) != generation) {
+    /* It may have been this very path; serve it once and forget it */
+    entry->unlinked = 1;
+    pthread_mutex_unlock(&shard->lock);
+    return entry;
+  }
+  /* Another worker may have resolved the same path meanwhile; replace it */
+  for (old = *bucket; old != NULL; old = old->chain) {
+    if (old->hash == entry->hash && strcmp(old->key, entry->key) == 0) {
+      pathcache_unlink(shard, old);
+      break;
+    }
+  }
+  while (shard->lru != NULL && shard->used >= pathcache_shard_capacity)
+    pathcache_unlink(shard, shard->lru->prev);
+
+  entry->chain = *bucket;
+  *bucket = entry;
+  DL_PREPEND(shard->lru, entry);
+  shard->used++;
+  pthread_mutex_unlock(&shard->lock);
+
+  return entry;
+}
+
+pathcache_entry_t *pathcache_lookup(char *path) {
+  if (!__atomic_load_n(&pathcache_enabled, __ATOMIC_RELAXED))
+    return pathcache_resolve(path, -1);
+
+  unsigned int hash = pathcache_hash(path);
+  pathcache_shard_t *shard = pathcache_shard(hash);
+  pathcache_entry_t *entry;
+
+  pthread_mutex_lock(&shard->lock);
+  for (entry = *pathcache_bucket(shard, hash); entry != NULL; entry = entry->chain) {
+    if (entry->hash == hash && strcmp(entry->key, path) == 0) {
+      DL_DELETE(shard->lru, entry);
+      DL_PREPEND(shard->lru, entry);
+      entry->refs++;
+      pthread_mutex_unlock(&shard->lock);
+      return entry;
+    }
+  }
+  pthread_mutex_unlock(&shard->lock);
+
+  /* Watch first: a change after this is reported, one before it is seen */
+  unsigned long generation = __atomic_load_n(&pathcache_generation, __ATOMIC_ACQUIRE);
+  entry = pathcache_resolve(path, pathcache_watch(path));
+  if (entry == NULL || entry->temporary)
+    return entry;
+  entry->hash = hash;
+  return pathcache_add(entry, generation);
+}
+
+void pathcache_release(pathcache_entry_t *entry) {
+  if (entry->temporary) {
+    pathcache_close(entry);
+    return;
+  }
+
+  pathcache_shard_t *shard = pathcache_shard(entry->hash);
+  int dead;
+
+  pthread_mutex_lock(&shard->lock);
+  dead = --entry->refs == 0 && entry->unlinked;
+  pthread_mutex_unlock(&shard->lock);
+
+  if (dead) {
+    pathcache_close(entry);
+    free(entry);
+  }
+}
+
+void pathcache_init(char *root, size_t max_entries) {
+  struct rlimit limit;
+
+  pathcache_root = root;
+  if (max_entries == 0)
+    return;
+
+  /* Entries hold up to two files open; leave most descriptors to clients */
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY &&
+      max_entries > limit.rlim_cur / 8)
+    max_entries = limit.rlim_cur / 8;
+
+  if ((pathcache_inotify_fd = inotify_init1(IN_CLOEXEC)) == -1) {
+    perror("Cannot watch served files; not caching paths");
+    return;
+  }
+  if ((pathcache_shards = calloc(PATHCACHE_SHARDS, sizeof(pathcache_shard_t))) == NULL) {
+    fprintf(stderr, "Error in creating path cache: %s\n", strerror(errno));
+    return;
+  }
+  pathcache_shard_capacity = (max_entries + PATHCACHE_SHARDS - 1) / PATHCACHE_SHARDS;
+
+  int i;
+  for (i = 0; i < PATHCACHE_SHARDS; i++)
+    pthread_mutex_init(&pathcache_shards[i].lock, NULL);
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, pathcache_watch_loop, NULL) != 0) {
+    fprintf(stderr, "Error in creating path cache watcher: %s\n", strerror(errno));
+    return;
+  }
+  pthread_detach(thread);
+  pathcache_enabled = 1;
+}
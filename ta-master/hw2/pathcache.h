@@ -0,0 +1,53 @@
+#ifndef __PATHCACHE__
+#define __PATHCACHE__
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+/* PATHCACHE remembers what request paths resolve to: the file, index.html or
+ * directory to serve, its stat, its MIME type and its precompressed .gz
+ * sibling, with the files kept open, so a hot path costs no filesystem
+ * calls at all. Like CACHE it is split into shards with a lock and an LRU
+ * list each.
+ *
+ * Instead of comparing entries with the disk, a background thread watches
+ * every directory entries came from with inotify and drops entries as soon
+ * as their file, their .gz sibling or (for listings) anything in their
+ * directory changes. Renaming or removing a directory drops everything.
+ * Changes to files outside the served tree, such as the targets of symbolic
+ * links, go unnoticed. */
+
+typedef struct pathcache_entry {
+  char *key;              // Request path
+  char *file_name;        // What it resolved to: a file, an index.html or a directory
+  int file_fd;            // Open file_name, or -1 for a directory
+  struct stat file_stat;  // Of file_fd, or of the directory
+  char *mime_type;        // From http_get_mime_type, never freed
+  char *gz_name;          // Sibling file_name.gz at least as new, or NULL
+  int gz_fd;              // Open gz_name, or -1
+  struct stat gz_stat;
+
+  int wd;                 // Watch of the directory file_name is in (or is)
+  char *base;             // Last part of file_name; NULL for directories
+  int temporary;          // Not cached; lives in the request's scratch memory
+
+  int refs;               // Workers still using this entry
+  int unlinked;           // Evicted or stale; freed on the last release
+  unsigned int hash;
+  struct pathcache_entry *next;   // LRU list, most recently used first
+  struct pathcache_entry *prev;
+  struct pathcache_entry *chain;  // Hash bucket
+} pathcache_entry_t;
+
+/* Sets up a cache of at most MAX_ENTRIES paths under the directory ROOT. 0
+ * disables it; lookups then resolve every path anew. */
+void pathcache_init(char *root, size_t max_entries);
+
+/* Returns what the request path PATH resolves to with a reference held, or
+ * NULL if there is nothing to serve there. */
+pathcache_entry_t *pathcache_lookup(char *path);
+
+/* Drops a reference returned by pathcache_lookup. */
+void pathcache_release(pathcache_entry_t *entry);
+
+#endif
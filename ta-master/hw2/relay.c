@@ -0,0 +1,253 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "relay.h"
+#include "utlist.h"
+
+#define RELAY_MAX_EVENTS 256
+
+/* A proxy reactor: one thread multiplexing many relays */
+struct relay_reactor {
+  int epoll_fd;
+  int wake_fd;                  // eventfd signalled when relays are submitted
+  pthread_mutex_t lock;         // Protects pending
+  struct relay *pending;        // Submitted, not yet registered
+};
+
+static struct relay_reactor *relay_reactors;
+static int relay_num_reactors;
+static unsigned int relay_next_reactor;
+static size_t relay_chunk_size;
+static void (*relay_release_upstream)(int);
+
+/* Move bytes one way until both ends would block. Returns -1 on error. */
+static int relay_direction_pump(struct relay_direction *direction, size_t chunk_size) {
+  int progress = 1;
+
+  while (progress && !direction->done) {
+    progress = 0;
+
+    /* Drain the pipe into the destination first to make room */
+    if (direction->pending > 0) {
+      ssize_t moved = splice(direction->pipe[0], NULL, direction->to, NULL,
+          direction->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (moved > 0) {
+        direction->pending -= moved;
+        progress = 1;
+      } else if (moved < 0 && errno != EAGAIN && errno != EINTR) {
+        return -1;
+      }
+    }
+
+    /* Then refill it from the source, but never beyond its capacity */
+    if (!direction->eof && direction->pending < chunk_size) {
+      ssize_t moved = splice(direction->from, NULL, direction->pipe[1], NULL,
+          chunk_size - direction->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (moved > 0) {
+        direction->pending += moved;
+        progress = 1;
+      } else if (moved == 0) {
+        direction->eof = 1;
+        progress = 1;
+      } else if (errno != EAGAIN && errno != EINTR) {
+        return -1;
+      }
+    }
+
+    /* Pass the end of the stream on once everything before it is out */
+    if (direction->eof && direction->pending == 0) {
+      shutdown(direction->to, SHUT_WR);
+      direction->done = 1;
+    }
+  }
+  return 0;
+}
+
+struct relay *relay_new(int client_fd, int upstream_fd, size_t chunk_size) {
+  struct relay *relay = calloc(1, sizeof(struct relay));
+  if (relay == NULL)
+    return NULL;
+
+  relay->client_fd = client_fd;
+  relay->upstream_fd = upstream_fd;
+  relay->chunk_size = chunk_size;
+
+  int i;
+  for (i = 0; i < 2; i++) {
+    struct relay_direction *direction = &relay->directions[i];
+    direction->from = i == 0 ? client_fd : upstream_fd;
+    direction->to = i == 0 ? upstream_fd : client_fd;
+    direction->pipe[0] = direction->pipe[1] = -1;
+    if (pipe2(direction->pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+      fprintf(stderr, "Error in creating relay pipe: %s\n", strerror(errno));
+      relay_free(relay);
+      return NULL;
+    }
+    /* Let the pipe hold a whole chunk; the kernel may round it up */
+    if (fcntl(direction->pipe[1], F_SETPIPE_SZ, (int) chunk_size) == -1)
+      relay->chunk_size = 65536;
+  }
+  return relay;
+}
+
+int relay_pump(struct relay *relay) {
+  int i;
+  for (i = 0; i < 2; i++) {
+    if (relay_direction_pump(&relay->directions[i], relay->chunk_size) < 0)
+      return -1;
+  }
+  return relay->directions[0].done && relay->directions[1].done ? 0 : 1;
+}
+
+void relay_free(struct relay *relay) {
+  int i, j;
+  for (i = 0; i < 2; i++) {
+    for (j = 0; j < 2; j++) {
+      if (relay->directions[i].pipe[j] != -1)
+        close(relay->directions[i].pipe[j]);
+    }
+  }
+  free(relay);
+}
+
+/* Stop relaying: drop both sockets from the reactor and close them */
+static void relay_finish(struct relay_reactor *reactor, struct relay *relay) {
+  epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, relay->client_fd, NULL);
+  epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, relay->upstream_fd, NULL);
+  close(relay->client_fd);
+  relay_release_upstream(relay->upstream_fd);
+  relay_free(relay);
+}
+
+/* Start watching relays handed over by relay_submit */
+static void relay_adopt(struct relay_reactor *reactor) {
+  uint64_t count;
+  struct relay *pending, *relay, *tmp;
+
+  if (read(reactor->wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+    perror("Error reading relay wakeup");
+
+  pthread_mutex_lock(&reactor->lock);
+  pending = reactor->pending;
+  reactor->pending = NULL;
+  pthread_mutex_unlock(&reactor->lock);
+
+  LL_FOREACH_SAFE(pending, relay, tmp) {
+    /* Edge triggered: relay_pump always goes until everything would block */
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET };
+    ev.data.ptr = relay;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, relay->client_fd, &ev) == -1 ||
+        epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, relay->upstream_fd, &ev) == -1) {
+      fprintf(stderr, "epoll_ctl - relay: %s\n", strerror(errno));
+      relay_finish(reactor, relay);
+    } else if (relay_pump(relay) != 1) {
+      relay_finish(reactor, relay);
+    }
+  }
+}
+
+static void *relay_loop(void *arg) {
+  struct relay_reactor *reactor = arg;
+  struct epoll_event events[RELAY_MAX_EVENTS];
+
+  while (1) {
+    int nfds = epoll_wait(reactor->epoll_fd, events, RELAY_MAX_EVENTS, -1);
+    if (nfds == -1) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "Error in epoll wait: %s\n", strerror(errno));
+      exit(errno);
+    }
+
+    /* Both sockets of a relay may report in one batch, so finished relays
+     * are only freed once the whole batch has been looked at */
+    struct relay *done = NULL, *relay, *tmp;
+    int n, adopt = 0;
+    for (n = 0; n < nfds; n++) {
+      relay = events[n].data.ptr;
+      if (relay == NULL) {
+        adopt = 1;
+      } else if (!relay->finished && relay_pump(relay) != 1) {
+        relay->finished = 1;
+        LL_PREPEND(done, relay);
+      }
+    }
+    LL_FOREACH_SAFE(done, relay, tmp)
+      relay_finish(reactor, relay);
+
+    if (adopt)
+      relay_adopt(reactor);
+  }
+
+  return NULL;
+}
+
+void relay_init(int num_reactors, size_t chunk_size, void (*release_upstream)(int)) {
+  if (num_reactors < 1)
+    num_reactors = 1;
+
+  relay_chunk_size = chunk_size;
+  relay_release_upstream = release_upstream;
+  relay_num_reactors = num_reactors;
+  relay_reactors = calloc(num_reactors, sizeof(struct relay_reactor));
+  if (relay_reactors == NULL) {
+    fprintf(stderr, "%s\n", strerror(errno));
+    exit(ENOMEM);
+  }
+
+  int i;
+  for (i = 0; i < num_reactors; i++) {
+    struct relay_reactor *reactor = &relay_reactors[i];
+    pthread_mutex_init(&reactor->lock, NULL);
+
+    if ((reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1 ||
+        (reactor->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+      perror("Failed to create proxy reactor");
+      exit(errno);
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->wake_fd, &ev) == -1) {
+      perror("epoll_ctl - relay wakeup");
+      exit(errno);
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, relay_loop, reactor) != 0) {
+      fprintf(stderr, "Error in creating proxy reactor: %s\n", strerror(errno));
+      exit(1);
+    }
+    pthread_detach(thread);
+  }
+}
+
+int relay_submit(int client_fd, int upstream_fd) {
+  struct relay *relay = relay_new(client_fd, upstream_fd, relay_chunk_size);
+  if (relay == NULL)
+    return -1;
+
+  /* Spread relays round robin; the reactor registers them itself so no
+   * event can reach a relay before it is fully set up */
+  unsigned int next = __atomic_fetch_add(&relay_next_reactor, 1, __ATOMIC_RELAXED);
+  struct relay_reactor *reactor = &relay_reactors[next % relay_num_reactors];
+
+  pthread_mutex_lock(&reactor->lock);
+  LL_PREPEND(reactor->pending, relay);
+  pthread_mutex_unlock(&reactor->lock);
+
+  uint64_t one = 1;
+  if (write(reactor->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+    perror("Error waking proxy reactor");
+  return 0;
+}
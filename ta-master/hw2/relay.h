@@ -0,0 +1,54 @@
+#ifndef __RELAY__
+#define __RELAY__
+
+#include <stddef.h>
+
+/* RELAY moves bytes between a client and the proxy target in both
+ * directions without copying them into user memory: each direction splices
+ * from the source socket into a pipe and from the pipe into the destination
+ * socket. A direction stops reading while its pipe is full, so a slow reader
+ * pushes back on the sender through TCP instead of growing our buffers.
+ *
+ * Relays run on a few shared proxy reactor threads, each multiplexing many
+ * client/target pairs with one epoll instance, so a proxied connection does
+ * not hold a worker thread for as long as it stays open. */
+
+struct relay_direction {
+  int from;
+  int to;
+  int pipe[2];
+  size_t pending;     // Bytes in the pipe not yet written to TO
+  int eof;            // FROM has nothing more to send
+  int done;           // Everything was forwarded and TO was shut down
+};
+
+struct relay {
+  int client_fd;
+  int upstream_fd;
+  size_t chunk_size;  // Pipe capacity; the most bytes in flight per direction
+  struct relay_direction directions[2];   // Client to target, target to client
+  int finished;       // Done or failed; freed at the end of the event batch
+  struct relay *next;
+};
+
+/* Sets up a relay between two non-blocking sockets. Returns NULL on failure. */
+struct relay *relay_new(int client_fd, int upstream_fd, size_t chunk_size);
+
+/* Moves as much as can be moved without blocking. Returns 1 while the relay
+ * has more to do, 0 once both directions are finished, -1 on error. */
+int relay_pump(struct relay *relay);
+
+/* Releases the pipes; the sockets are left to the caller. */
+void relay_free(struct relay *relay);
+
+/* Starts NUM_REACTORS proxy reactor threads. Relays get pipes of
+ * CHUNK_SIZE bytes; RELEASE_UPSTREAM is called with the target socket of
+ * each relay once it finishes. */
+void relay_init(int num_reactors, size_t chunk_size, void (*release_upstream)(int));
+
+/* Hands two non-blocking sockets to a proxy reactor, which relays between
+ * them and then closes CLIENT_FD and releases UPSTREAM_FD. Returns -1, with
+ * both sockets still the caller's, if the relay could not be set up. */
+int relay_submit(int client_fd, int upstream_fd);
+
+#endif
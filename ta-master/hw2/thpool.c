@@ -2,81 +2,413 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <sched.h>
+#include <unistd.h>
 
 #include "wq.h"
+#include "thpool.h"
+#include "metrics.h"
+#include "affinity.h"
 
-pthread_t *p_threads; 			// Threads in thread pool
-int num_request = 0;  			// No of request
-wq_t *wq; 						// Work Queue
+/* Empty rounds a worker spins through before it goes to sleep */
+#define THPOOL_SPIN_LIMIT 64
+
+/*
+ * Per-worker deque (Chase-Lev). The owning worker pushes and takes at the
+ * bottom without contention; idle workers steal from the top with a single
+ * compare-and-swap.
+ */
+typedef struct deque {
+	long top __attribute__((aligned(WQ_CACHE_LINE)));
+	long bottom __attribute__((aligned(WQ_CACHE_LINE)));
+	thpool_task_t tasks[THPOOL_DEQUE_SIZE];
+} deque_t;
+
+/* Worker slot states */
+enum { SLOT_EMPTY, SLOT_RUNNING };
+
+typedef struct worker {
+	int id;
+	int state;						// SLOT_EMPTY or SLOT_RUNNING
+	unsigned int seed;				// For picking steal victims
+	struct pool *pool;
+	thpool_stats_t stats;			// Written by the worker only
+	deque_t deque;
+} worker_t;
+
+/* The workers of one NUMA node, fed by the node's own listeners; there is
+ * just the one pool without NUMA grouping */
+typedef struct pool {
+	int node;
+	worker_t *workers;				// One slot per possible thread
+	int num_workers;				// Slots, i.e. the maximum no of threads
+	int min_workers;
+	int live_workers;				// Threads currently running
+	wq_t *wq; 						// Work Queue, fed by the accept threads
+	uint64_t max_queue_wait;		// Longest queue wait since the last scaler tick
+} pool_t;
+
+pool_t *pools;
+int num_pools;
 
-pthread_mutex_t mutex; 			// For mutual exclusion
-pthread_cond_t job_queue; 		// Job queue
 void (*request_handler)(int); 	// Request handler
+void (*late_handler)(int);		// For requests that waited too long
+
+int thpool_idle_timeout = 30;
+int thpool_wait_target = 50;
+size_t thpool_max_queue;
+int thpool_queue_timeout;
+
+static __thread worker_t *current_worker;	// NULL outside the pool
+
+
+/* Owner only: push a task at the bottom. Returns -1 if the deque is full */
+static int deque_push(deque_t *deque, thpool_task_t task) {
+	long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+	long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+	if (bottom - top >= THPOOL_DEQUE_SIZE)
+		return -1;
+
+	deque->tasks[bottom & (THPOOL_DEQUE_SIZE - 1)] = task;
+	__atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Owner only: take the most recently pushed task */
+static int deque_take(deque_t *deque, thpool_task_t *task) {
+	long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+	__atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	long top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+	if (top > bottom) {
+		/* Empty */
+		__atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	*task = deque->tasks[bottom & (THPOOL_DEQUE_SIZE - 1)];
+	if (top == bottom) {
+		/* Last task: race the thieves for it */
+		int won = __atomic_compare_exchange_n(&deque->top, &top, top + 1, 0,
+				__ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+		__atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+		return won;
+	}
+	return 1;
+}
+
+/* Any thread: take the oldest task */
+static int deque_steal(deque_t *deque, thpool_task_t *task) {
+	long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+	if (top >= bottom)
+		return 0;
+
+	*task = deque->tasks[top & (THPOOL_DEQUE_SIZE - 1)];
+	return __atomic_compare_exchange_n(&deque->top, &top, top + 1, 0,
+			__ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+static int deque_empty(deque_t *deque) {
+	return __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE) >=
+		__atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+}
 
 
-/* push request to the work queue */
-void add_to_work_queue(int fd) {
-	/* Push the request to the work queue */
-	pthread_mutex_lock(&mutex);
-	num_request++;
-	wq_push(wq, fd);
-	
-	// Signal
-	pthread_cond_signal(&job_queue);
+/* push request to the work queue of the caller's node */
+int add_to_work_queue(int fd) {
+	wq_t *wq = pools[affinity_node() % num_pools].wq;
+
+	/* Past the high-water mark, turning requests away beats queueing them */
+	if (thpool_max_queue > 0 && wq_size(wq) >= thpool_max_queue)
+		return -1;
+	/* Push the request to the work queue; the queue wakes a sleeping worker */
+	return wq_push(wq, fd);
+}
+
+/* No of requests waiting for a thread */
+size_t work_queue_size(void) {
+	size_t size = 0;
+	int i;
+	for (i = 0; i < num_pools; i++)
+		size += wq_size(pools[i].wq);
+	return size;
+}
+
+/* Queue a task on the calling worker's own deque */
+void thpool_submit(void (*function)(int), int arg) {
+	thpool_task_t task = { function, arg };
+
+	if (current_worker == NULL || deque_push(&current_worker->deque, task) == -1) {
+		function(arg);
+		return;
+	}
+	/* Let a sleeping worker come and steal it */
+	wq_wake(current_worker->pool->wq);
+}
+
+/* Steal from the other workers of the node, starting at a random one */
+static int steal_task(worker_t *self, thpool_task_t *task) {
+	pool_t *pool = self->pool;
+	int i;
+	self->seed = self->seed * 1103515245 + 12345;
+	int start = (self->seed >> 16) % pool->num_workers;
+
+	for (i = 0; i < pool->num_workers; i++) {
+		worker_t *victim = &pool->workers[(start + i) % pool->num_workers];
+		if (victim != self && deque_steal(&victim->deque, task))
+			return 1;
+	}
+	return 0;
+}
+
+/* Whether any work is waiting anywhere on POOL */
+static int work_pending(pool_t *pool) {
+	int i;
+	if (wq_size(pool->wq) > 0)
+		return 1;
+	for (i = 0; i < pool->num_workers; i++) {
+		if (!deque_empty(&pool->workers[i].deque))
+			return 1;
+	}
+	return 0;
+}
+
+/* Remember the longest time a request waited for a thread, and record it */
+static uint64_t note_queue_wait(pool_t *pool, uint64_t enqueued) {
+	uint64_t wait = wq_clock() - enqueued;
+	metrics_record(METRICS_QUEUE, wait);
+	uint64_t seen = __atomic_load_n(&pool->max_queue_wait, __ATOMIC_RELAXED);
+	while (wait > seen && !__atomic_compare_exchange_n(&pool->max_queue_wait, &seen, wait, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+	return wait;
+}
+
+/* Count a task the worker found in one of its places */
+static void count_task(uint64_t *counter) {
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + 1,
+			__ATOMIC_RELAXED);
+}
+
+/* Find the next task: own deque first, then new requests, then steal */
+static int next_task(worker_t *self, thpool_task_t *task) {
+	uint64_t enqueued;
+	int fd;
+	if (deque_take(&self->deque, task)) {
+		count_task(&self->stats.local);
+		return 1;
+	}
+	if ((fd = wq_try_pop(self->pool->wq, &enqueued)) != -1) {
+		/* The client has likely given up on a request this late */
+		uint64_t wait = note_queue_wait(self->pool, enqueued);
+		task->function = thpool_queue_timeout > 0 &&
+			wait > thpool_queue_timeout * 1000000ULL ? late_handler : request_handler;
+		task->arg = fd;
+		count_task(&self->stats.queued);
+		return 1;
+	}
+	if (steal_task(self, task)) {
+		count_task(&self->stats.stolen);
+		return 1;
+	}
+	return 0;
+}
 
-	pthread_mutex_unlock(&mutex);
+void thpool_stats(thpool_stats_t *stats) {
+	int i, j;
+	memset(stats, 0, sizeof(*stats));
+	for (i = 0; i < num_pools; i++) {
+		for (j = 0; j < pools[i].num_workers; j++) {
+			thpool_stats_t *worker = &pools[i].workers[j].stats;
+			stats->queued += __atomic_load_n(&worker->queued, __ATOMIC_RELAXED);
+			stats->local += __atomic_load_n(&worker->local, __ATOMIC_RELAXED);
+			stats->stolen += __atomic_load_n(&worker->stolen, __ATOMIC_RELAXED);
+		}
+	}
 }
 
+/* Leave the pool if there are more than min_workers threads */
+static int retire(worker_t *self) {
+	pool_t *pool = self->pool;
+	int live = __atomic_load_n(&pool->live_workers, __ATOMIC_RELAXED);
+	while (live > pool->min_workers) {
+		if (__atomic_compare_exchange_n(&pool->live_workers, &live, live - 1, 1,
+					__ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+			/* Our deque is empty: only we push to it, and we found no work */
+			__atomic_store_n(&self->state, SLOT_EMPTY, __ATOMIC_RELEASE);
+			return 1;
+		}
+	}
+	return 0;
+}
 
 /* assign a thread to a request */
 void* assign_thread(void * arg) {
+	worker_t *self = arg;
+	pool_t *pool = self->pool;
+	thpool_task_t task;
+	int spins = 0;
+	uint64_t idle_since = 0;
+
+	/* Pinned before its scratch memory is first touched, so that comes
+	 * from the node too */
+	affinity_pin_worker(pool->node);
+	current_worker = self;
 	while(1) {
-		pthread_mutex_lock(&mutex);
+		if (next_task(self, &task)) {
+			task.function(task.arg);
+			spins = 0;
+			idle_since = 0;
+			continue;
+		}
+		if (++spins < THPOOL_SPIN_LIMIT) {
+			sched_yield();
+			continue;
+		}
 
-		if(num_request == 0) {
-			pthread_cond_wait(&job_queue, &mutex);
+		if (idle_since == 0) {
+			idle_since = wq_clock();
+		} else if (wq_clock() - idle_since >= thpool_idle_timeout * 1000000000ULL &&
+				retire(self)) {
+			break;
 		}
-		int fd = wq_pop(wq);
-		num_request--;
-		
-		pthread_mutex_unlock(&mutex);
-		request_handler(fd);
+
+		/* Look once more after announcing we are about to sleep */
+		int ticket = wq_prepare_wait(pool->wq);
+		if (work_pending(pool))
+			wq_cancel_wait(pool->wq);
+		else
+			wq_wait(pool->wq, ticket, pool->min_workers < pool->num_workers ?
+					thpool_idle_timeout * 1000 : -1);
+		spins = 0;
 	}
-	
+
+	current_worker = NULL;
 	return NULL;
 }
 
-/* Initialize thread pool
- * On success returns 1, Otherwise returns 0
- */
-int thpool_init(int num_threads, void (*req_handler)(int)) {
-	request_handler = req_handler;
+/* Start a thread in a free slot of POOL. Returns 0 if it is at its maximum */
+static int spawn_worker(pool_t *pool) {
+	int i;
+	for (i = 0; i < pool->num_workers; i++) {
+		worker_t *worker = &pool->workers[i];
+		int empty = SLOT_EMPTY;
+		if (!__atomic_compare_exchange_n(&worker->state, &empty, SLOT_RUNNING, 0,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			continue;
 
-	wq = (wq_t*)malloc(sizeof(wq_t));
-	wq_init(wq);
+		pthread_t thread;
+		__atomic_add_fetch(&pool->live_workers, 1, __ATOMIC_SEQ_CST);
+		if (pthread_create(&thread, NULL, &assign_thread, worker) != 0) {
+			fprintf(stderr, "Error in pthread creation: %s\n", strerror(errno));
+			__atomic_sub_fetch(&pool->live_workers, 1, __ATOMIC_SEQ_CST);
+			__atomic_store_n(&worker->state, SLOT_EMPTY, __ATOMIC_RELEASE);
+			return 0;
+		}
+		pthread_detach(thread);
+		return 1;
+	}
+	return 0;
+}
 
-	if( (p_threads = (pthread_t*) malloc(sizeof(pthread_t) * num_threads)) == NULL ) {
-		fprintf(stderr, "Error in creating thread: %s\n", strerror(errno));
+/* Grow the pool while requests pile up or wait longer than the target */
+void* autoscale(void *arg) {
+	int i;
+	while(1) {
+		usleep(THPOOL_SCALE_INTERVAL * 1000);
+
+		for (i = 0; i < num_pools; i++) {
+			pool_t *pool = &pools[i];
+			size_t backlog = wq_size(pool->wq);
+			uint64_t wait = __atomic_exchange_n(&pool->max_queue_wait, 0, __ATOMIC_RELAXED);
+			int idle = __atomic_load_n(&pool->wq->sleepers, __ATOMIC_RELAXED);
+
+			size_t wanted = 0;
+			if (backlog > (size_t) idle)
+				wanted = backlog - idle;
+			if (wanted == 0 && wait > thpool_wait_target * 1000000ULL)
+				wanted = 1;
+
+			while (wanted-- > 0 && spawn_worker(pool))
+				;
+		}
+	}
+	return NULL;
+}
+
+/* Set up POOL for NODE with MIN_THREADS to MAX_THREADS threads, its queue
+ * and worker slots in the node's memory. On success returns 1 */
+static int pool_init(pool_t *pool, int node, int min_threads, int max_threads) {
+	pool->node = node;
+	affinity_prefer_node(node);
+
+	if( (pool->wq = (wq_t*)malloc(sizeof(wq_t))) == NULL ) {
+		fprintf(stderr, "Error in creating work queue: %s\n", strerror(errno));
 		return 0;
 	}
+	wq_init(pool->wq, thpool_max_queue > THPOOL_QUEUE_CAPACITY ? thpool_max_queue :
+			THPOOL_QUEUE_CAPACITY);
 
-	if(pthread_mutex_init(&mutex, NULL) != 0) {
-		fprintf(stderr, "Error in initializing mutex: %s\n", strerror(errno));
+	if( posix_memalign((void **) &pool->workers, WQ_CACHE_LINE, sizeof(worker_t) * max_threads) != 0 ) {
+		fprintf(stderr, "Error in creating thread: %s\n", strerror(errno));
 		return 0;
 	}
+	memset(pool->workers, 0, sizeof(worker_t) * max_threads);
+	affinity_prefer_node(-1);
+	pool->num_workers = max_threads;
+	pool->min_workers = min_threads;
 
-	if(pthread_cond_init(&job_queue, NULL) != 0) {
-		fprintf(stderr, "Error in initializing condition variable: %s\n", strerror(errno));
+	int i;
+	for(i=0; i<max_threads; i++) {
+		pool->workers[i].id = i;
+		pool->workers[i].seed = i + 1;
+		pool->workers[i].pool = pool;
+	}
+	for(i=0; i<min_threads; i++) {
+		if (!spawn_worker(pool))
+			return 0;
+	}
+	return 1;
+}
+
+/* Initialize thread pool
+ * On success returns 1, Otherwise returns 0
+ */
+int thpool_init(int min_threads, int max_threads, void (*req_handler)(int),
+		void (*reject_handler)(int)) {
+	request_handler = req_handler;
+	late_handler = reject_handler;
+
+	/* One pool per node, with the threads shared out between them */
+	num_pools = affinity_num_nodes();
+	if (num_pools > max_threads)
+		num_pools = max_threads;
+	if( (pools = calloc(num_pools, sizeof(pool_t))) == NULL ) {
+		fprintf(stderr, "Error in creating thread pool: %s\n", strerror(errno));
 		return 0;
 	}
 
 	int i;
-	for(i=0; i<num_threads; i++) {
-		if( pthread_create(&p_threads[i], NULL, &assign_thread, NULL) != 0) {
+	for(i=0; i<num_pools; i++) {
+		int max = max_threads / num_pools + (i < max_threads % num_pools);
+		int min = min_threads / num_pools + (i < min_threads % num_pools);
+		if (min < 1)
+			min = 1;
+		if (!pool_init(&pools[i], i, min, max))
+			return 0;
+	}
+
+	if (min_threads < max_threads) {
+		pthread_t scaler;
+		if( pthread_create(&scaler, NULL, &autoscale, NULL) != 0) {
 			fprintf(stderr, "Error in pthread creation: %s\n", strerror(errno));
 			return 0;
 		}
+		pthread_detach(scaler);
 	}
   	return 1;
 
-}
\ No newline at end of file
+}
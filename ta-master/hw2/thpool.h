@@ -1,9 +1,67 @@
 #include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
 
-/* push request to the work queue */
-void add_to_work_queue(int fd);
+/* Most requests that can wait for a thread at once */
+#define THPOOL_QUEUE_CAPACITY 65536
 
-/* Initialize thread pool
+/* Tasks each worker can hold in its own deque */
+#define THPOOL_DEQUE_SIZE 256
+
+typedef struct thpool_task {
+	void (*function)(int);
+	int arg;
+} thpool_task_t;
+
+/* Requests that may wait for a thread (on each node) before new ones are
+ * turned away; 0 allows THPOOL_QUEUE_CAPACITY */
+extern size_t thpool_max_queue;
+
+/* Milliseconds a request may wait for a thread before it is turned away
+ * instead of served; 0 waits as long as it takes */
+extern int thpool_queue_timeout;
+
+/* push request to the work queue of the node the caller is pinned on
+ * Returns 0, or -1 if the queue is at thpool_max_queue
+ */
+int add_to_work_queue(int fd);
+
+/* No of requests waiting for a thread */
+size_t work_queue_size(void);
+
+/* Run FUNCTION(ARG) later on the pool. Called from a worker, the task goes
+ * on that worker's own deque, where it stays close to the connection state
+ * the worker just touched unless an idle worker steals it. Called from
+ * outside the pool (or with a full deque) it runs right away.
+ */
+void thpool_submit(void (*function)(int), int arg);
+
+/* Tasks workers have run, by where they found them */
+typedef struct thpool_stats {
+	uint64_t queued;	// The shared request queue
+	uint64_t local;		// Their own deque, from thpool_submit
+	uint64_t stolen;	// Another worker's deque
+} thpool_stats_t;
+
+/* Sums the task counts of every worker into STATS */
+void thpool_stats(thpool_stats_t *stats);
+
+/* Milliseconds between autoscaler checks */
+#define THPOOL_SCALE_INTERVAL 100
+
+/* Seconds a thread above the minimum may sit idle before it exits */
+extern int thpool_idle_timeout;
+
+/* Milliseconds a request may wait for a thread before the pool grows */
+extern int thpool_wait_target;
+
+/* Initialize thread pool with MIN_THREADS threads. If MAX_THREADS is larger,
+ * an autoscaler adds threads while requests queue up or wait longer than
+ * thpool_wait_target, and idle threads above the minimum exit again.
+ * Requests that waited past thpool_queue_timeout go to REJECT_HANDLER.
+ * With NUMA grouping (see affinity.h) each node gets a pool of its own,
+ * pinned to it, and the threads are shared out between the pools.
  * On success returns 1, Otherwise returns 0
  */
-int thpool_init(int num_threads, void (*req_handler)(int));
\ No newline at end of file
+int thpool_init(int min_threads, int max_threads, void (*req_handler)(int),
+		void (*reject_handler)(int));
@@ -0,0 +1,91 @@
+/*
+ * Thread pool benchmark: runs trees of tasks on the pool. Each root request
+ * comes in through the shared queue and spawns two follow-up tasks, which
+ * spawn two more each down to DEPTH. Follow-ups go either on the spawning
+ * worker's own deque (thpool_submit) or back through the shared queue, and
+ * for each way the benchmark prints throughput and where workers found
+ * their tasks.
+ *
+ * Usage: ./thpool_bench [roots] [threads] [depth]
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "thpool.h"
+
+/* Rounds of busy work in each task, about as long as a small cached reply */
+#define BENCH_WORK 2000
+
+static int bench_local;         // Follow-ups via thpool_submit
+static long bench_done;         // Tasks finished so far
+
+static void bench_task(int depth) {
+  volatile unsigned int sink = 0;
+  int i;
+  for (i = 0; i < BENCH_WORK; i++)
+    sink += i;
+
+  if (depth > 0) {
+    for (i = 0; i < 2; i++) {
+      if (bench_local)
+        thpool_submit(bench_task, depth - 1);
+      else
+        while (add_to_work_queue(depth - 1) == -1)
+          sched_yield();
+    }
+  }
+  __atomic_add_fetch(&bench_done, 1, __ATOMIC_RELEASE);
+}
+
+static void bench_run(const char *name, long roots, int depth) {
+  thpool_stats_t before, after;
+  struct timespec start, end;
+  long i, per_root = (2L << depth) - 1, tasks = roots * per_root;
+
+  thpool_stats(&before);
+  __atomic_store_n(&bench_done, 0, __ATOMIC_RELAXED);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < roots; i++) {
+    /* Keep unfinished tasks below what the queue holds, or workers pushing
+     * follow-ups onto a full queue would wait on each other for good */
+    while (i * per_root - __atomic_load_n(&bench_done, __ATOMIC_ACQUIRE) >
+        THPOOL_QUEUE_CAPACITY / 2)
+      sched_yield();
+    while (add_to_work_queue(depth) == -1)
+      sched_yield();
+  }
+  while (__atomic_load_n(&bench_done, __ATOMIC_ACQUIRE) < tasks)
+    sched_yield();
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  thpool_stats(&after);
+
+  double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("%-8s %12.2f %12llu %12llu %12llu\n", name, tasks / seconds / 1e6,
+      (unsigned long long) (after.queued - before.queued),
+      (unsigned long long) (after.local - before.local),
+      (unsigned long long) (after.stolen - before.stolen));
+}
+
+int main(int argc, char **argv) {
+  long roots = argc > 1 ? atol(argv[1]) : 20000;
+  int threads = argc > 2 ? atoi(argv[2]) : 4;
+  int depth = argc > 3 ? atoi(argv[3]) : 4;
+  if (roots <= 0 || threads < 1 || depth < 0 || depth > 14) {
+    fprintf(stderr, "Usage: %s [roots] [threads] [depth (0-14)]\n", argv[0]);
+    return 1;
+  }
+
+  if (!thpool_init(threads, threads, bench_task, bench_task))
+    return 1;
+
+  printf("%ld roots, %d threads, depth %d\n", roots, threads, depth);
+  printf("%-8s %12s %12s %12s %12s\n", "follow", "Mtasks/s", "queued", "local", "stolen");
+  bench_local = 0;
+  bench_run("queue", roots, depth);
+  bench_local = 1;
+  bench_run("deque", roots, depth);
+  return 0;
+}
@@ -0,0 +1,278 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "upstream.h"
+
+/* Seconds between health checks of ready connections */
+#define UPSTREAM_CHECK_INTERVAL 1
+
+/* Ready connections older than this are replaced; targets drop idle peers */
+#define UPSTREAM_MAX_IDLE 30
+
+/* Seconds a stale address is used before looking the target up again when
+ * a lookup fails */
+#define UPSTREAM_DNS_RETRY 5
+
+/* Seconds upstream_connect waits for a free slot under max_conns */
+#define UPSTREAM_WAIT_TIMEOUT 5
+
+/* Seconds a connection gets to be established before the target is taken
+ * for unreachable */
+#define UPSTREAM_CONNECT_TIMEOUT 3
+
+struct ready_conn {
+  int fd;
+  time_t since;
+};
+
+static struct upstream {
+  char *hostname;
+  int port;
+  int preconnect;
+  int max_conns;
+  int dns_ttl;
+
+  pthread_mutex_t lock;
+  pthread_cond_t changed;       // A connection was taken, added or released
+  struct ready_conn *ready;     // Connected ahead of use, newest last
+  int num_ready;
+  int num_open;                 // Ready, in use, or being connected
+
+  struct sockaddr_in address;   // Cached lookup of hostname
+  time_t address_expires;
+} upstream;
+
+/* Resolve the target, reusing the cached address until its TTL runs out */
+static int upstream_address(struct sockaddr_in *address) {
+  time_t now = time(NULL);
+
+  pthread_mutex_lock(&upstream.lock);
+  int cached = upstream.address_expires > now;
+  *address = upstream.address;
+  pthread_mutex_unlock(&upstream.lock);
+  if (cached)
+    return 0;
+
+  struct addrinfo hints, *result;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  int rc = getaddrinfo(upstream.hostname, NULL, &hints, &result);
+  if (rc != 0) {
+    fprintf(stderr, "Cannot find host %s: %s\n", upstream.hostname, gai_strerror(rc));
+    if (address->sin_family != AF_INET)
+      return -1;
+    /* Keep using the last good address for a while rather than stall every
+     * request on the lookup while DNS is down */
+    pthread_mutex_lock(&upstream.lock);
+    upstream.address_expires = now + UPSTREAM_DNS_RETRY;
+    pthread_mutex_unlock(&upstream.lock);
+    return 0;
+  }
+
+  memcpy(address, result->ai_addr, sizeof(*address));
+  address->sin_port = htons(upstream.port);
+  freeaddrinfo(result);
+
+  pthread_mutex_lock(&upstream.lock);
+  upstream.address = *address;
+  upstream.address_expires = now + upstream.dns_ttl;
+  pthread_mutex_unlock(&upstream.lock);
+  return 0;
+}
+
+/* Open a new connection; the caller has already reserved a slot */
+static int upstream_open(void) {
+  struct sockaddr_in address;
+  if (upstream_address(&address) == -1)
+    return -1;
+
+  int fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    fprintf(stderr, "Failed to create a new socket: error %d: %s\n", errno, strerror(errno));
+    return -1;
+  }
+
+  int option = 1;
+  setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &option, sizeof(option));
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+
+  /* Connect without blocking, so an unreachable target costs a worker
+   * UPSTREAM_CONNECT_TIMEOUT at most rather than the kernel's SYN retries */
+  if (connect(fd, (struct sockaddr *) &address, sizeof(address)) == -1) {
+    if (errno != EINPROGRESS) {
+      close(fd);
+      return -1;
+    }
+
+    struct timespec now, deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += UPSTREAM_CONNECT_TIMEOUT;
+    int rc, error = ETIMEDOUT;
+    socklen_t error_len = sizeof(error);
+    do {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      long left = (deadline.tv_sec - now.tv_sec) * 1000 +
+        (deadline.tv_nsec - now.tv_nsec) / 1000000;
+      struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+      rc = left > 0 ? poll(&pfd, 1, left) : 0;
+    } while (rc < 0 && errno == EINTR);
+    if (rc < 0 || (rc > 0 && getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == -1))
+      error = errno;
+    if (error != 0) {
+      fprintf(stderr, "Cannot connect to %s: %s\n", upstream.hostname, strerror(error));
+      close(fd);
+      return -1;
+    }
+  }
+
+  /* Hand out a blocking socket; the relay switches it over itself */
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags == -1 || fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* A ready connection is healthy if the target hasn't closed it or sent
+ * anything unasked */
+static int upstream_healthy(int fd) {
+  char byte;
+  ssize_t rc = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+  return rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/* Drop dead or stale ready connections. Called with the lock held. */
+static void upstream_check_ready(void) {
+  time_t now = time(NULL);
+  int i, kept = 0;
+
+  for (i = 0; i < upstream.num_ready; i++) {
+    struct ready_conn *conn = &upstream.ready[i];
+    if (now - conn->since < UPSTREAM_MAX_IDLE && upstream_healthy(conn->fd)) {
+      upstream.ready[kept++] = *conn;
+    } else {
+      close(conn->fd);
+      upstream.num_open--;
+    }
+  }
+  upstream.num_ready = kept;
+}
+
+/* Keep enough connections ready, and healthy */
+static void *upstream_maintain(void *arg) {
+  pthread_mutex_lock(&upstream.lock);
+  while (1) {
+    upstream_check_ready();
+
+    while (upstream.num_ready < upstream.preconnect && upstream.num_open < upstream.max_conns) {
+      upstream.num_open++;
+      pthread_mutex_unlock(&upstream.lock);
+      int fd = upstream_open();
+      pthread_mutex_lock(&upstream.lock);
+
+      if (fd == -1) {
+        /* Target is down; try again on the next round */
+        upstream.num_open--;
+        break;
+      }
+      upstream.ready[upstream.num_ready].fd = fd;
+      upstream.ready[upstream.num_ready].since = time(NULL);
+      upstream.num_ready++;
+      pthread_cond_broadcast(&upstream.changed);
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += UPSTREAM_CHECK_INTERVAL;
+    pthread_cond_timedwait(&upstream.changed, &upstream.lock, &deadline);
+  }
+  return NULL;
+}
+
+void upstream_init(char *hostname, int port, int preconnect, int max_conns, int dns_ttl) {
+  upstream.hostname = hostname;
+  upstream.port = port;
+  upstream.max_conns = max_conns;
+  upstream.preconnect = preconnect < max_conns ? preconnect : max_conns;
+  upstream.dns_ttl = dns_ttl;
+  pthread_mutex_init(&upstream.lock, NULL);
+  pthread_cond_init(&upstream.changed, NULL);
+
+  if ((upstream.ready = calloc(upstream.preconnect + 1, sizeof(struct ready_conn))) == NULL) {
+    fprintf(stderr, "%s\n", strerror(errno));
+    exit(ENOMEM);
+  }
+
+  pthread_t thread;
+  if (upstream.preconnect > 0) {
+    if (pthread_create(&thread, NULL, upstream_maintain, NULL) != 0) {
+      fprintf(stderr, "Error in creating upstream connector: %s\n", strerror(errno));
+      exit(1);
+    }
+    pthread_detach(thread);
+  }
+}
+
+int upstream_connect(void) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += UPSTREAM_WAIT_TIMEOUT;
+
+  pthread_mutex_lock(&upstream.lock);
+  while (1) {
+    /* Newest ready connection first: least likely to have been dropped */
+    while (upstream.num_ready > 0) {
+      int fd = upstream.ready[--upstream.num_ready].fd;
+      if (upstream_healthy(fd)) {
+        pthread_cond_broadcast(&upstream.changed);
+        pthread_mutex_unlock(&upstream.lock);
+        return fd;
+      }
+      close(fd);
+      upstream.num_open--;
+    }
+
+    if (upstream.num_open < upstream.max_conns)
+      break;
+    if (pthread_cond_timedwait(&upstream.changed, &upstream.lock, &deadline) == ETIMEDOUT) {
+      pthread_mutex_unlock(&upstream.lock);
+      return -1;
+    }
+  }
+
+  /* Nothing ready; connect ourselves */
+  upstream.num_open++;
+  pthread_cond_broadcast(&upstream.changed);
+  pthread_mutex_unlock(&upstream.lock);
+
+  int fd = upstream_open();
+  if (fd == -1) {
+    pthread_mutex_lock(&upstream.lock);
+    upstream.num_open--;
+    pthread_cond_broadcast(&upstream.changed);
+    pthread_mutex_unlock(&upstream.lock);
+  }
+  return fd;
+}
+
+void upstream_release(int fd) {
+  close(fd);
+  pthread_mutex_lock(&upstream.lock);
+  upstream.num_open--;
+  pthread_cond_broadcast(&upstream.changed);
+  pthread_mutex_unlock(&upstream.lock);
+}
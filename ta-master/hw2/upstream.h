@@ -0,0 +1,29 @@
+#ifndef __UPSTREAM__
+#define __UPSTREAM__
+
+/* UPSTREAM manages connections to the proxy target. A background thread
+ * connects a few ahead of time, so a proxied client doesn't wait for DNS
+ * and the TCP handshake, checks that the unused ones are still alive, and
+ * caps how many connections the target gets from us. The target's address
+ * is resolved once and cached for a TTL, and connecting gives up after a
+ * few seconds.
+ *
+ * This is a preconnect pool, not a keep-alive pool: connections are never
+ * reused. The relay splices bytes both ways without parsing requests or
+ * responses, so it can't tell when the target is done with one; each
+ * connection carries a single client connection, then closes. Reuse would
+ * mean parsing the HTTP framing of both directions in the relay. */
+
+/* Starts keeping up to PRECONNECT connections to HOSTNAME:PORT open ahead
+ * of use, with at most MAX_CONNS open (ready or in use) at any time.
+ * Lookups are cached for DNS_TTL seconds. */
+void upstream_init(char *hostname, int port, int preconnect, int max_conns, int dns_ttl);
+
+/* Returns a connected (blocking) socket to the target, ideally one
+ * connected ahead of time, or -1 if none could be made in time. */
+int upstream_connect(void);
+
+/* Closes a socket from upstream_connect and frees its slot. */
+void upstream_release(int fd);
+
+#endif
@@ -1,38 +1,164 @@
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 #include "wq.h"
-#include "utlist.h"
+
+/* Empty polls before a consumer goes to sleep */
+#define WQ_SPIN_LIMIT 64
+
+static void futex_wait(int *address, int value, struct timespec *timeout) {
+  syscall(SYS_futex, address, FUTEX_WAIT_PRIVATE, value, timeout, NULL, 0);
+}
+
+uint64_t wq_clock(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void futex_wake(int *address, int count) {
+  syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
 
 /* Initializes a work queue WQ. */
-void wq_init(wq_t *wq) {
+void wq_init(wq_t *wq, size_t capacity) {
+  size_t size = 2, i;
+  while (size < capacity)
+    size <<= 1;
 
-  /* TODO: Make me thread-safe! */
+  if ((wq->items = calloc(size, sizeof(wq_item_t))) == NULL) {
+    fprintf(stderr, "Error in creating work queue: %s\n", strerror(errno));
+    exit(ENOMEM);
+  }
+  for (i = 0; i < size; i++)
+    wq->items[i].sequence = i;
 
-  wq->size = 0;
-  wq->head = NULL;
+  wq->mask = size - 1;
+  wq->head = wq->tail = 0;
+  wq->wakeups = 0;
+  wq->sleepers = 0;
 }
 
-/* Remove an item from the WQ. This function should block until there
- * is at least one item on the queue. */
-int wq_pop(wq_t *wq) {
+/* Add ITEM to WQ. */
+int wq_push(wq_t *wq, int client_socket_fd) {
+  wq_item_t *item;
+  size_t tail = __atomic_load_n(&wq->tail, __ATOMIC_RELAXED);
+
+  while (1) {
+    item = &wq->items[tail & wq->mask];
+    size_t sequence = __atomic_load_n(&item->sequence, __ATOMIC_ACQUIRE);
+    long diff = (long) sequence - (long) tail;
 
-  /* TODO: Make me blocking and thread-safe! */
+    if (diff == 0) {
+      /* Slot is free; claim it */
+      if (__atomic_compare_exchange_n(&wq->tail, &tail, tail + 1, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0) {
+      /* Slot still holds an item from the previous lap */
+      return -1;
+    } else {
+      tail = __atomic_load_n(&wq->tail, __ATOMIC_RELAXED);
+    }
+  }
 
-  wq_item_t *wq_item = wq->head;
-  int client_socket_fd = wq->head->client_socket_fd;
-  wq->size--;
-  DL_DELETE(wq->head, wq->head);
+  item->client_socket_fd = client_socket_fd;
+  item->enqueued = wq_clock();
+  __atomic_store_n(&item->sequence, tail + 1, __ATOMIC_RELEASE);
+
+  wq_wake(wq);
+  return 0;
+}
+
+void wq_wake(wq_t *wq) {
+  /* Pairs with the fence in wq_prepare_wait: either we see the sleeper or
+   * it sees the new work before going to sleep */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&wq->sleepers, __ATOMIC_RELAXED) > 0) {
+    __atomic_add_fetch(&wq->wakeups, 1, __ATOMIC_RELEASE);
+    futex_wake(&wq->wakeups, 1);
+  }
+}
 
-  free(wq_item);
+int wq_prepare_wait(wq_t *wq) {
+  __atomic_add_fetch(&wq->sleepers, 1, __ATOMIC_SEQ_CST);
+  int ticket = __atomic_load_n(&wq->wakeups, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  return ticket;
+}
+
+void wq_wait(wq_t *wq, int ticket, int timeout_ms) {
+  struct timespec timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+  futex_wait(&wq->wakeups, ticket, timeout_ms < 0 ? NULL : &timeout);
+  __atomic_sub_fetch(&wq->sleepers, 1, __ATOMIC_RELAXED);
+}
+
+void wq_cancel_wait(wq_t *wq) {
+  __atomic_sub_fetch(&wq->sleepers, 1, __ATOMIC_RELAXED);
+}
+
+int wq_try_pop(wq_t *wq, uint64_t *enqueued) {
+  wq_item_t *item;
+  size_t head = __atomic_load_n(&wq->head, __ATOMIC_RELAXED);
+
+  while (1) {
+    item = &wq->items[head & wq->mask];
+    size_t sequence = __atomic_load_n(&item->sequence, __ATOMIC_ACQUIRE);
+    long diff = (long) sequence - (long) (head + 1);
+
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&wq->head, &head, head + 1, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0) {
+      /* Nothing published in this slot yet */
+      return -1;
+    } else {
+      head = __atomic_load_n(&wq->head, __ATOMIC_RELAXED);
+    }
+  }
+
+  int client_socket_fd = item->client_socket_fd;
+  if (enqueued != NULL)
+    *enqueued = item->enqueued;
+  /* Hand the slot to the producer one lap ahead */
+  __atomic_store_n(&item->sequence, head + wq->mask + 1, __ATOMIC_RELEASE);
   return client_socket_fd;
 }
 
-/* Add ITEM to WQ. */
-void wq_push(wq_t *wq, int client_socket_fd) {
+/* Remove an item from the WQ. This function should block until there
+ * is at least one item on the queue. */
+int wq_pop(wq_t *wq) {
+  int client_socket_fd, spins = 0;
+
+  while (1) {
+    if ((client_socket_fd = wq_try_pop(wq, NULL)) != -1)
+      return client_socket_fd;
+    if (++spins < WQ_SPIN_LIMIT) {
+      sched_yield();
+      continue;
+    }
 
-  /* TODO: Make me thread-safe! */
+    /* Announce ourselves, then look once more before sleeping */
+    int ticket = wq_prepare_wait(wq);
+    if ((client_socket_fd = wq_try_pop(wq, NULL)) != -1) {
+      wq_cancel_wait(wq);
+      return client_socket_fd;
+    }
+    wq_wait(wq, ticket, -1);
+    spins = 0;
+  }
+}
 
-  wq_item_t *wq_item = calloc(1, sizeof(wq_item_t));
-  wq_item->client_socket_fd = client_socket_fd;
-  DL_APPEND(wq->head, wq_item);
-  wq->size++;
+size_t wq_size(wq_t *wq) {
+  size_t tail = __atomic_load_n(&wq->tail, __ATOMIC_RELAXED);
+  size_t head = __atomic_load_n(&wq->head, __ATOMIC_RELAXED);
+  return tail > head ? tail - head : 0;
 }
@@ -2,24 +2,73 @@
 #define __WQ__
 
 #include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
 
 /* WQ defines a work queue which will be used to store accepted client sockets
- * waiting to be served. */
+ * waiting to be served.
+ *
+ * It is a bounded lock-free ring buffer that any number of threads may push to
+ * and pop from concurrently (Vyukov's MPMC queue). Each slot carries a
+ * sequence number telling producers and consumers whose turn it is, so the
+ * only shared writes are one compare-and-swap on the head or tail. Idle
+ * consumers sleep on a futex instead of a mutex/condition variable. */
+
+#define WQ_CACHE_LINE 64
 
 typedef struct wq_item {
+  size_t sequence;      // Turn number of the slot
   int client_socket_fd; // Client socket to be served.
-  struct wq_item *next;
-  struct wq_item *prev;
+  uint64_t enqueued;    // wq_clock() when it was pushed
 } wq_item_t;
 
 typedef struct wq {
-  int size;
-  wq_item_t *head;
-  /* TODO: More stuff here, maybe? */
+  wq_item_t *items;
+  size_t mask;          // Capacity - 1; capacity is a power of two
+
+  /* Producers and consumers each get their own cache line */
+  size_t tail __attribute__((aligned(WQ_CACHE_LINE)));
+  size_t head __attribute__((aligned(WQ_CACHE_LINE)));
+
+  int wakeups __attribute__((aligned(WQ_CACHE_LINE)));  // Futex word
+  int sleepers;         // Consumers parked on wakeups
 } wq_t;
 
-void wq_init(wq_t *wq);
-void wq_push(wq_t *wq, int client_socket_fd);
+/* Initializes WQ to hold up to CAPACITY sockets (rounded up to a power of two). */
+void wq_init(wq_t *wq, size_t capacity);
+
+/* Adds a socket. Returns 0, or -1 without blocking if the queue is full. */
+int wq_push(wq_t *wq, int client_socket_fd);
+
+/* Removes a socket, sleeping until there is one. */
 int wq_pop(wq_t *wq);
 
+/* Removes a socket if there is one. Returns -1 if the queue is empty.
+ * If ENQUEUED isn't NULL it receives the time the socket was pushed. */
+int wq_try_pop(wq_t *wq, uint64_t *enqueued);
+
+/* Monotonic time in nanoseconds, the clock queue times are measured on. */
+uint64_t wq_clock(void);
+
+/* Approximate number of queued sockets. */
+size_t wq_size(wq_t *wq);
+
+/*
+ * Parking for consumers that also wait for work from elsewhere:
+ *
+ *     int ticket = wq_prepare_wait(wq);
+ *     if (there is work after all)
+ *       wq_cancel_wait(wq);
+ *     else
+ *       wq_wait(wq, ticket, -1);   // Returns after any wq_push or wq_wake
+ *
+ * wq_wait gives up after TIMEOUT_MS milliseconds unless that is negative.
+ */
+int wq_prepare_wait(wq_t *wq);
+void wq_wait(wq_t *wq, int ticket, int timeout_ms);
+void wq_cancel_wait(wq_t *wq);
+
+/* Wakes one parked consumer, if any. */
+void wq_wake(wq_t *wq);
+
 #endif
@@ -0,0 +1,150 @@
+/*
+ * Work queue benchmark: pushes ITEMS fds through the lock-free wq and through
+ * the mutex/condition-variable linked list the thread pool used before it,
+ * with 1 to 64 consumer threads, and prints throughput for each.
+ *
+ * Usage: ./wq_bench [items] [producers]
+ */
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "wq.h"
+#include "utlist.h"
+
+#define BENCH_DONE INT_MAX
+#define BENCH_MAX_THREADS 64
+
+/* The previous implementation: one lock and condition variable guarding a
+ * doubly linked list with one calloc'd node per socket */
+typedef struct locked_item {
+  int client_socket_fd;
+  struct locked_item *next;
+  struct locked_item *prev;
+} locked_item_t;
+
+typedef struct locked_queue {
+  int size;
+  locked_item_t *head;
+  pthread_mutex_t mutex;
+  pthread_cond_t job_queue;
+} locked_queue_t;
+
+static void locked_push(locked_queue_t *queue, int fd) {
+  pthread_mutex_lock(&queue->mutex);
+  locked_item_t *item = calloc(1, sizeof(locked_item_t));
+  item->client_socket_fd = fd;
+  DL_APPEND(queue->head, item);
+  queue->size++;
+  pthread_cond_signal(&queue->job_queue);
+  pthread_mutex_unlock(&queue->mutex);
+}
+
+static int locked_pop(locked_queue_t *queue) {
+  pthread_mutex_lock(&queue->mutex);
+  while (queue->size == 0)
+    pthread_cond_wait(&queue->job_queue, &queue->mutex);
+  locked_item_t *item = queue->head;
+  int fd = item->client_socket_fd;
+  DL_DELETE(queue->head, item);
+  queue->size--;
+  pthread_mutex_unlock(&queue->mutex);
+  free(item);
+  return fd;
+}
+
+struct bench {
+  int lock_free;
+  locked_queue_t locked;
+  wq_t wq;
+  long items;
+  int producers;
+  int consumers;
+};
+
+static void bench_push(struct bench *bench, int fd) {
+  if (!bench->lock_free) {
+    locked_push(&bench->locked, fd);
+    return;
+  }
+  while (wq_push(&bench->wq, fd) == -1)
+    sched_yield();
+}
+
+static int bench_pop(struct bench *bench) {
+  return bench->lock_free ? wq_pop(&bench->wq) : locked_pop(&bench->locked);
+}
+
+static void *producer(void *arg) {
+  struct bench *bench = arg;
+  long i, share = bench->items / bench->producers;
+  for (i = 0; i < share; i++)
+    bench_push(bench, (int) (i & 0xffff));
+  return NULL;
+}
+
+static void *consumer(void *arg) {
+  struct bench *bench = arg;
+  while (bench_pop(bench) != BENCH_DONE)
+    ;
+  return NULL;
+}
+
+/* Returns millions of items moved per second */
+static double bench_run(struct bench *bench) {
+  pthread_t producers[BENCH_MAX_THREADS], consumers[BENCH_MAX_THREADS];
+  struct timespec start, end;
+  int i;
+
+  if (bench->lock_free) {
+    wq_init(&bench->wq, 4096);
+  } else {
+    bench->locked.size = 0;
+    bench->locked.head = NULL;
+    pthread_mutex_init(&bench->locked.mutex, NULL);
+    pthread_cond_init(&bench->locked.job_queue, NULL);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < bench->consumers; i++)
+    pthread_create(&consumers[i], NULL, consumer, bench);
+  for (i = 0; i < bench->producers; i++)
+    pthread_create(&producers[i], NULL, producer, bench);
+  for (i = 0; i < bench->producers; i++)
+    pthread_join(producers[i], NULL);
+  for (i = 0; i < bench->consumers; i++)
+    bench_push(bench, BENCH_DONE);
+  for (i = 0; i < bench->consumers; i++)
+    pthread_join(consumers[i], NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  if (bench->lock_free)
+    free(bench->wq.items);
+
+  double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  return bench->items / seconds / 1e6;
+}
+
+int main(int argc, char **argv) {
+  struct bench bench;
+  bench.items = argc > 1 ? atol(argv[1]) : 2000000;
+  bench.producers = argc > 2 ? atoi(argv[2]) : 1;
+  if (bench.items <= 0 || bench.producers < 1 || bench.producers > BENCH_MAX_THREADS) {
+    fprintf(stderr, "Usage: %s [items] [producers (1-%d)]\n", argv[0], BENCH_MAX_THREADS);
+    return 1;
+  }
+
+  printf("%ld items, %d producer(s)\n", bench.items, bench.producers);
+  printf("%8s %16s %16s\n", "threads", "mutex (Mops/s)", "wq (Mops/s)");
+  for (bench.consumers = 1; bench.consumers <= BENCH_MAX_THREADS; bench.consumers *= 2) {
+    bench.lock_free = 0;
+    double locked = bench_run(&bench);
+    bench.lock_free = 1;
+    double lock_free = bench_run(&bench);
+    printf("%8d %16.2f %16.2f\n", bench.consumers, locked, lock_free);
+  }
+  return 0;
+}